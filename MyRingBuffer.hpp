@@ -81,6 +81,17 @@ public:
     return true; // goodie!
   }
 
+  // a prompt such as "> " that is waiting for input, so no line terminator follows it
+  bool pop_prompt(char ch) {
+    int i = pop_idx;
+    for (; i!=push_idx &&  is_term(buff[i]); i=next_idx(i)); // skip leading terminators
+    if (i==push_idx || buff[i]!=ch) return false;
+    i = next_idx(i);
+    if (i!=push_idx && buff[i]==' ') i = next_idx(i);
+    pop_idx = i;
+    return true;
+  }
+
   String pop_string() {
     String ret;
     int i = pop_idx;
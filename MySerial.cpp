@@ -2,18 +2,41 @@
 #include "logging.hpp"
 #include "wiring_private.h" // pinPeripheral() function
 
-MySerial::MySerial(const char* id, bool echo_tx, bool echo_rx) : logger(logging::get(String(id)+"-tx")), logger_rx(logging::get(String(id)+"-rx")), echo_tx(echo_tx), echo_rx(echo_rx) {}
+MySerial::MySerial(logging::Id tx_id, logging::Id rx_id, bool echo_tx, bool echo_rx) : logger(logging::get(tx_id)), logger_rx(logging::get(rx_id)), echo_tx(echo_tx), echo_rx(echo_rx) {}
 
 
 void MySerial::begin(unsigned long baudrate, uint8_t pinRX, uint8_t pinTX, _EPioType pinTypeRX, _EPioType pinTypeTX, SercomRXPad padRX, SercomUartTXPad padTX, SERCOM* sercom)
 {
   this->sercom = sercom;
+  this->padRX = padRX;
+  this->padTX = padTX;
   pinPeripheral(pinRX, pinTypeRX);
   pinPeripheral(pinTX, pinTypeTX);
+  initSercom(baudrate);
+}
+
+void MySerial::initSercom(unsigned long baudrate)
+{
+  this->baudrate = baudrate;
   sercom->initUART(UART_INT_CLOCK, SAMPLE_RATE_x16, baudrate);
   sercom->initFrame(UART_CHAR_SIZE_8_BITS, LSB_FIRST, SERCOM_NO_PARITY, SERCOM_STOP_BIT_1);
   sercom->initPads(padTX, padRX);
   sercom->enableUART();
+
+  // After RTS goes up the other side still finishes what is in its transmitter, and the rx
+  // interrupt may be held off for a bit; both are worth more bytes the faster the line runs.
+  // Allow for about 2ms of data on top of a few characters, twice that as hysteresis.
+  int headroom = 8 + baudrate / 5000;
+  rts_rx_stop = rx_buffer.capacity() - headroom;
+  rts_rx_cont = rx_buffer.capacity() - 2 * headroom;
+}
+
+void MySerial::setBaud(unsigned long baudrate)
+{
+  if (baudrate == this->baudrate) return;
+  sercom->resetUART(); // BAUD is enable-protected, so start over with the same settings
+  initSercom(baudrate);
+  updateRts();
 }
 
 void MySerial::begin_hs(unsigned long baudrate, uint8_t pinRX, uint8_t pinTX, uint8_t pinRTS, uint8_t pinCTS, _EPioType pinTypeRX, _EPioType pinTypeTX, _EPioType pinTypeRTS, _EPioType pinTypeCTS, SercomRXPad padRX, SercomUartTXPad padTX, SERCOM* sercom)
@@ -1,11 +1,11 @@
 #pragma once
 #include "common.hpp"
 #include "MyRingBuffer.hpp"
+#include "logging.hpp"
 #include <HardwareSerial.h>
 #include <deque>
 
 
-class Logger;
 class SERCOM;
 class MySerial : public HardwareSerial
 {
@@ -15,11 +15,15 @@ class MySerial : public HardwareSerial
   bool echo_rx;
   
   SERCOM* sercom = nullptr;
+  SercomRXPad padRX;
+  SercomUartTXPad padTX;
+  unsigned long baudrate = 0;
+  void initSercom(unsigned long baudrate);
 
   // rx_buffer
   MyRingBuffer<2048> rx_buffer;
-  const int rts_rx_stop = rx_buffer.capacity() - 10;
-  const int rts_rx_cont = rx_buffer.capacity() - 20;
+  int rts_rx_stop = rx_buffer.capacity() - 10;
+  int rts_rx_cont = rx_buffer.capacity() - 20;
 
   // handshaking
   bool handshakeEnabled = false;
@@ -28,7 +32,7 @@ class MySerial : public HardwareSerial
   void updateRts();
 
 public:
-  MySerial(const char* id, bool echo_tx, bool echo_rx);
+  MySerial(logging::Id tx_id, logging::Id rx_id, bool echo_tx, bool echo_rx);
 
   void begin(unsigned long) {
     assert(0);
@@ -43,6 +47,12 @@ public:
   
   void end();
 
+  // Reconfigure the SERCOM for another rate, keeping pins, handshaking and whatever is in the rx buffer
+  void setBaud(unsigned long baudrate);
+  unsigned long baud() {
+    return baudrate;
+  }
+
   void flush();
 
   void IrqHandler();
@@ -68,6 +78,12 @@ public:
     return tmp;
   }
 
+  bool popPrompt(char ch) {
+    bool found = rx_buffer.pop_prompt(ch);
+    if (found) updateRts();
+    return found;
+  }
+
 };
 
 
@@ -6,7 +6,7 @@
 
 namespace simcom
 {
-  Logger& logger = logging::get("simcom");
+  Logger& logger = logging::get(logging::SIMCOM);
   
   const auto PIN_GPS_EN = 26ul;
   const auto PIN_STATUS = 25ul;
@@ -49,11 +49,33 @@ namespace simcom
   }
   
   
-  void begin() 
+  void restart()
+  {
+    if (isOn()) {
+      powerOnOff();
+      for (int i=0; i<8; i++) {
+        delay(100);
+        watchdog::tickle();
+      }
+    }
+    powerOnOff();
+  }
+  
+  void begin(bool warm) 
   {
     pinMode(PIN_GPS_EN, INPUT); // high-z
     pinMode(PIN_STATUS, INPUT_PULLDOWN);
     pinMode(PIN_PWRKEY, INPUT_PULLDOWN);
+
+    // After a warm restart the module normally is still on and registered; use it as it is
+    if (warm && isOn()) {
+      logger.println("Warm restart, keeping SimCom on");
+      if (gsm::begin(gps::prime, true)) {
+        gps::begin(true);
+        watchdog::tickle();
+        return;
+      }
+    }
   
     // If module already on, reset it
     if (isOn()) {
@@ -71,8 +93,16 @@ namespace simcom
     powerOnOff();
     assert(isOn());
   
-    // GSM
-    gsm::begin(gps::prime);
+    // GSM; if the module cannot be talked to, e.g. left at a rate the line does not carry, power-cycle it
+    const int gsm_attempts = 3;
+    for (int attempt = 1; !gsm::begin(gps::prime); attempt++) {
+      if (attempt == gsm_attempts) {
+        LOG_ERROR(logger, "Modem still not answering after %d power cycles", attempt - 1);
+        break;
+      }
+      LOG_WARNING(logger, "Modem not answering, power-cycling (attempt %d)", attempt);
+      restart();
+    }
 
     // GPS
     gps::begin();
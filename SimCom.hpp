@@ -3,7 +3,7 @@
 
 namespace simcom
 {
-  void begin();
+  void begin(bool warm = false);
   bool isOn();
   void powerOnOff();
   void update(unsigned long timestamp, unsigned long delta);
@@ -0,0 +1,41 @@
+#pragma once
+#include "common.hpp"
+
+// Queue between one interrupt handler and the main loop, with no locking: only push() writes
+// push_idx and only pop() writes pop_idx. The indices run freely and wrap at 2^32, so S has to
+// be a power of two and every slot is usable.
+template<typename T, uint32_t S>
+class SpscQueue
+{
+  static_assert((S & (S - 1)) == 0, "S must be a power of two");
+  T buff[S];
+  volatile uint32_t push_idx = 0;
+  volatile uint32_t pop_idx = 0;
+public:
+  bool push(const T& item)
+  {
+    uint32_t i = push_idx;
+    if (i - pop_idx == S) return false;
+    buff[i % S] = item;
+    __DMB(); // the item is in place before the consumer can see it
+    push_idx = i + 1;
+    return true;
+  }
+
+  bool pop(T& item)
+  {
+    uint32_t i = pop_idx;
+    if (i == push_idx) return false;
+    __DMB();
+    item = buff[i % S];
+    __DMB(); // done reading before the producer may overwrite it
+    pop_idx = i + 1;
+    return true;
+  }
+
+  uint32_t size()
+  {
+    return push_idx - pop_idx;
+  }
+};
+
@@ -0,0 +1,67 @@
+#include "aggregate.hpp"
+#include "logging.hpp"
+
+namespace aggregate
+{
+  Logger& logger = logging::get(logging::AGGREGATE);
+
+  const uint16_t max_count = 0xffff;
+
+  unsigned long window_ms = 0;
+  unsigned long start = 0;
+  uint16_t count = 0;
+  int32_t sum[axes];
+  uint64_t sumsq[axes];
+  int16_t min_[axes];
+  int16_t max_[axes];
+
+
+  void setWindow(unsigned long ms)
+  {
+    if (ms == window_ms) return;
+    LOG_INFO(logger, "Window %lums -> %lums", window_ms, ms);
+    window_ms = ms;
+  }
+
+  unsigned long window()
+  {
+    return window_ms;
+  }
+
+  bool add(unsigned long timestamp, uint32_t sample_us, const imu::Data& data, Window& out)
+  {
+    const int16_t* v = &data.ax; // Data is nine int16_t in a row
+    if (count == 0) {
+      start = timestamp;
+      for (int i=0; i<axes; i++) {
+        sum[i] = 0;
+        sumsq[i] = 0;
+        min_[i] = max_[i] = v[i];
+      }
+    }
+    for (int i=0; i<axes; i++) {
+      int32_t x = v[i];
+      sum[i] += x;
+      sumsq[i] += (uint32_t)(x * x);
+      if (v[i] < min_[i]) min_[i] = v[i];
+      if (v[i] > max_[i]) max_[i] = v[i];
+    }
+    count++;
+
+    if (timestamp - start < window_ms && count < max_count) return false;
+
+    out.timestamp = timestamp;
+    out.sample_us = sample_us;
+    out.count = count;
+    for (int i=0; i<axes; i++) {
+      // round half away from zero
+      out.mean[i] = (sum[i] >= 0 ? sum[i] + count / 2 : sum[i] - count / 2) / count;
+      out.min[i] = min_[i];
+      out.max[i] = max_[i];
+      out.rms[i] = sqrtf((float)sumsq[i] / count);
+    }
+    count = 0;
+    return true;
+  }
+}
+
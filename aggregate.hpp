@@ -0,0 +1,29 @@
+#pragma once
+#include "common.hpp"
+#include "imu.hpp"
+
+// Boxcar decimator between the IMU and the log: every sample lands in the current window, and a
+// window comes out as per-axis mean, min, max and RMS, so a low log rate still shows vibration
+// instead of aliasing it.
+namespace aggregate
+{
+  const int axes = 9; // imu::Data order: ax, ay, az, gx, gy, gz, mx, my, mz
+
+  struct Window
+  {
+    unsigned long timestamp; // last sample in the window
+    uint32_t sample_us;      // and its timebase capture
+    uint16_t count;
+    int16_t mean[axes];
+    int16_t min[axes];
+    int16_t max[axes];
+    float rms[axes]; // about zero, not about the mean; sd = sqrt(rms^2 - mean^2)
+  };
+
+  void setWindow(unsigned long ms); // 0 passes every sample through as its own window
+  unsigned long window();
+
+  // true when this sample closed a window, which is then in out
+  bool add(unsigned long timestamp, uint32_t sample_us, const imu::Data& data, Window& out);
+}
+
@@ -0,0 +1,134 @@
+#include "ahrs.hpp"
+#include "watchdog.hpp"
+
+namespace ahrs
+{
+  const float twoKp = 2.f * 0.5f; // proportional gain
+  const float twoKi = 2.f * 0.0f; // integral gain, off: the gyro bias is small against a flight's duration
+
+  Quaternion q;
+  float integralFBx = 0.f, integralFBy = 0.f, integralFBz = 0.f;
+
+  // one Newton step on the classic bit-level initial guess; ~0.2% error, far cheaper than 1/sqrtf() in soft-float
+  float invSqrt(float x)
+  {
+    float halfx = 0.5f * x;
+    uint32_t i;
+    memcpy(&i, &x, sizeof(i));
+    i = 0x5f3759df - (i >> 1);
+    float y;
+    memcpy(&y, &i, sizeof(y));
+    return y * (1.5f - halfx * y * y);
+  }
+
+  void reset()
+  {
+    q = Quaternion();
+    integralFBx = integralFBy = integralFBz = 0.f;
+  }
+
+  void update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz, float dt)
+  {
+    float q0 = q.q0, q1 = q.q1, q2 = q.q2, q3 = q.q3;
+
+    // Only correct against the accelerometer when it is valid; the magnetometer joins in if it is too
+    if (!(ax==0.f && ay==0.f && az==0.f)) {
+      float recipNorm = invSqrt(ax * ax + ay * ay + az * az);
+      ax *= recipNorm;
+      ay *= recipNorm;
+      az *= recipNorm;
+
+      float q0q0 = q0 * q0, q0q1 = q0 * q1, q0q2 = q0 * q2, q0q3 = q0 * q3;
+      float q1q1 = q1 * q1, q1q2 = q1 * q2, q1q3 = q1 * q3;
+      float q2q2 = q2 * q2, q2q3 = q2 * q3;
+      float q3q3 = q3 * q3;
+
+      // estimated direction of gravity
+      float halfvx = q1q3 - q0q2;
+      float halfvy = q0q1 + q2q3;
+      float halfvz = q0q0 - 0.5f + q3q3;
+
+      // error is the cross product between estimated and measured directions
+      float halfex = ay * halfvz - az * halfvy;
+      float halfey = az * halfvx - ax * halfvz;
+      float halfez = ax * halfvy - ay * halfvx;
+
+      if (!(mx==0.f && my==0.f && mz==0.f)) {
+        recipNorm = invSqrt(mx * mx + my * my + mz * mz);
+        mx *= recipNorm;
+        my *= recipNorm;
+        mz *= recipNorm;
+
+        // reference direction of the earth's field
+        float hx = 2.f * (mx * (0.5f - q2q2 - q3q3) + my * (q1q2 - q0q3) + mz * (q1q3 + q0q2));
+        float hy = 2.f * (mx * (q1q2 + q0q3) + my * (0.5f - q1q1 - q3q3) + mz * (q2q3 - q0q1));
+        float hh = hx * hx + hy * hy;
+        float bx = hh * invSqrt(hh + 1e-12f); // sqrt(hh) without sqrtf
+        float bz = 2.f * (mx * (q1q3 - q0q2) + my * (q2q3 + q0q1) + mz * (0.5f - q1q1 - q2q2));
+
+        // estimated direction of the field
+        float halfwx = bx * (0.5f - q2q2 - q3q3) + bz * (q1q3 - q0q2);
+        float halfwy = bx * (q1q2 - q0q3) + bz * (q0q1 + q2q3);
+        float halfwz = bx * (q0q2 + q1q3) + bz * (0.5f - q1q1 - q2q2);
+
+        halfex += my * halfwz - mz * halfwy;
+        halfey += mz * halfwx - mx * halfwz;
+        halfez += mx * halfwy - my * halfwx;
+      }
+
+      if (twoKi > 0.f) {
+        integralFBx += twoKi * halfex * dt;
+        integralFBy += twoKi * halfey * dt;
+        integralFBz += twoKi * halfez * dt;
+        gx += integralFBx;
+        gy += integralFBy;
+        gz += integralFBz;
+      }
+
+      gx += twoKp * halfex;
+      gy += twoKp * halfey;
+      gz += twoKp * halfez;
+    }
+
+    // integrate rate of change of quaternion
+    float half_dt = 0.5f * dt;
+    gx *= half_dt;
+    gy *= half_dt;
+    gz *= half_dt;
+    float qa = q0, qb = q1, qc = q2;
+    q0 += -qb * gx - qc * gy - q3 * gz;
+    q1 += qa * gx + qc * gz - q3 * gy;
+    q2 += qa * gy - qb * gz + q3 * gx;
+    q3 += qa * gz + qb * gy - qc * gx;
+
+    float recipNorm = invSqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+    q.q0 = q0 * recipNorm;
+    q.q1 = q1 * recipNorm;
+    q.q2 = q2 * recipNorm;
+    q.q3 = q3 * recipNorm;
+  }
+
+  const Quaternion& get()
+  {
+    return q;
+  }
+
+  unsigned long benchmark()
+  {
+    Quaternion saved = q;
+    const unsigned long duration_us = 200000;
+    unsigned long updates = 0;
+    unsigned long start = micros();
+    unsigned long elapsed = 0;
+    while (elapsed < duration_us) {
+      for (int i=0; i<16; i++, updates++) {
+        update(0.01f * i, -0.02f, 0.3f, 120.f + i, -40.f, 16000.f, 200.f, -90.f + i, 400.f, 0.005f);
+      }
+      elapsed = micros() - start;
+    }
+    watchdog::tickle();
+    q = saved;
+    return (unsigned long)(updates * 1000000ull / elapsed);
+  }
+}
+
@@ -0,0 +1,24 @@
+#pragma once
+#include "common.hpp"
+
+// Mahony complementary filter (R. Mahony et al., "Nonlinear Complementary Filters on the Special
+// Orthogonal Group", 2008), written for soft-float: no divisions or sqrt in the hot path beyond
+// two fast inverse square roots.
+namespace ahrs
+{
+  struct Quaternion
+  {
+    float q0 = 1.f, q1 = 0.f, q2 = 0.f, q3 = 0.f;
+  };
+
+  void reset();
+
+  // gyro in rad/s; accelerometer and magnetometer in any (consistent per sensor) unit, they get normalised
+  void update(float gx, float gy, float gz, float ax, float ay, float az, float mx, float my, float mz, float dt);
+
+  const Quaternion& get();
+
+  // run the filter on synthetic input for a while and return updates per second
+  unsigned long benchmark();
+}
+
@@ -1,16 +1,22 @@
 #include "common.hpp"
 #include "logging.hpp"
 #include "watchdog.hpp"
+#include "crashlog.hpp"
 #include <Wire.h>
 
 namespace {
-  Logger& logger = logging::get("common");
+  Logger& logger = logging::get(logging::COMMON);
 }
 
 void assert_handler(const char* expr, const char* file, int line)
 {
   watchdog::tickle();
-  logger.println(String("Assertion failed: ") + expr + " in " + file + ":" + String(line));
+  bool was_synchronous = logging::isSynchronous();
+  logging::emergency();
+  LOG_ERROR(logger, "Assertion failed: %s in %s:%d", expr, file, line);
+  char reason[48];
+  snprintf(reason, sizeof(reason), "assert %s:%d", file, line);
+  crashlog::setReason(reason);
   logger.println();
   watchdog::tickle();
   logger.flush();
@@ -24,6 +30,9 @@ void assert_handler(const char* expr, const char* file, int line)
     delay(100);
   }
   watchdog::tickle();
+
+  // we carry on, so back to queueing: interrupt handlers log too and must not write to Serial and SD themselves
+  logging::setSynchronous(was_synchronous);
  
   //interrupts();
   #ifdef DEBUG
@@ -8,6 +8,9 @@
 // general config
 #define DEBUG
 #define PIN_LED 8
+//#define IMU_SIM // run the imu against imusim's register model instead of the MPU9250
+//#define LOG_BINARY // LOG_* macros write binary records to EVT.BIN in the session directory (decode with tools/logdecode.py) instead of text lines
+//#define TELEMETRY_TCP // upload binary frames over a socket kept open to tools/groundstation.py instead of one http GET per sample
 
 
 // define assert handler
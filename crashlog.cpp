@@ -0,0 +1,252 @@
+#include "crashlog.hpp"
+#include "logging.hpp"
+#include <algorithm>
+#include <stddef.h>
+
+namespace crashlog
+{
+  Logger& logger = logging::get(logging::CRASHLOG);
+
+  const uint32_t magic = 0xc0ffee03; // bump when State changes
+  const int ring_size = 640;
+
+  struct State
+  {
+    uint32_t magic;
+    uint32_t boot_count;
+    uint32_t uptime_ms;
+    char reason[48];
+    Resume resume;
+    imu::Data imu;
+    uint32_t gga_time;
+    int16_t fix;
+    char latitude[12];
+    char longitude[12];
+    char altitude[10];
+    uint16_t ring_pos;
+    uint8_t ring_wrapped;
+    char ring[ring_size];
+    uint32_t sum; // of every byte above; kept up to date on each store()
+  };
+
+  // Not zeroed by the startup code. The Arduino SAMD linker script has no .noinit output section,
+  // and before GCC 12 a section of that name is emitted as PROGBITS, which ld would place with
+  // .data and give a flash image. So force it to NOBITS: "@" starts a comment in ARM assembly and
+  // swallows the flags GCC appends. ld then puts the orphan after .bss, ahead of the .heap
+  // section where `end` (the start of the heap) is defined. begin() checks that it did.
+  __attribute__((section(".noinit,\"aw\",%nobits@"))) State state;
+  extern "C" char __bss_end__;
+  extern "C" char end;
+  bool placed = false; // state lies between .bss and the heap; otherwise it is never touched
+
+  bool previous_valid = false;
+  bool warm_start = false;
+  bool recording = false;
+  Resume previous_resume;
+  uint8_t reset_cause = 0;
+
+
+  uint32_t computeSum()
+  {
+    const uint8_t* p = (const uint8_t*)&state;
+    uint32_t sum = 0;
+    for (size_t i=0; i<offsetof(State, sum); i++) sum += p[i];
+    return sum;
+  }
+
+  // Write into state, adjusting the checksum by the difference, so that it stays valid whenever
+  // we might hang. Interrupt handlers log too, hence the critical section.
+  void store(void* dst, const void* src, size_t len)
+  {
+    if (!placed) return;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    for (size_t i=0; i<len; i++) {
+      state.sum += s[i] - d[i];
+      d[i] = s[i];
+    }
+    __set_PRIMASK(primask);
+  }
+
+  template<typename T>
+  void storeValue(T& dst, const T& value)
+  {
+    store(&dst, &value, sizeof(T));
+  }
+
+  void storeString(char* dst, size_t size, const char* src)
+  {
+    char tmp[64] = {0};
+    strncpy(tmp, src, std::min(size, sizeof(tmp)) - 1);
+    store(dst, tmp, size);
+  }
+
+  void startRecord(uint32_t boot_count)
+  {
+    if (!placed) return;
+    Resume resume = state.resume; // whatever setup() already set for this session
+    memset(&state, 0, sizeof(state));
+    state.magic = magic;
+    state.boot_count = boot_count;
+    state.resume = resume;
+    state.resume.running = 0;
+    state.sum = computeSum();
+    recording = true;
+  }
+
+
+  void begin()
+  {
+    reset_cause = PM->RCAUSE.reg;
+    placed = (char*)&state >= &__bss_end__ && (char*)(&state + 1) <= &end;
+    if (!placed) return;
+    previous_valid = state.magic == magic && state.sum == computeSum();
+    warm_start = previous_valid && state.resume.running && (reset_cause & (PM_RCAUSE_WDT | PM_RCAUSE_SYST));
+    if (previous_valid) {
+      previous_resume = state.resume;
+    } else {
+      memset(&state, 0, sizeof(state)); // so startRecord() carries nothing over
+    }
+  }
+
+  const char* resetCauseName()
+  {
+    if (reset_cause & PM_RCAUSE_WDT) return "watchdog";
+    if (reset_cause & PM_RCAUSE_SYST) return "system reset request";
+    if (reset_cause & PM_RCAUSE_EXT) return "reset pin";
+    if (reset_cause & (PM_RCAUSE_BOD12 | PM_RCAUSE_BOD33)) return "brown-out";
+    if (reset_cause & PM_RCAUSE_POR) return "power-on";
+    return "unknown";
+  }
+
+  void report()
+  {
+    LOG_INFO(logger, "Reset cause: %s (RCAUSE 0x%02x)", resetCauseName(), reset_cause);
+    if (!placed) LOG_ERROR(logger, "Crash record at %p is not between .bss and the heap (%p..%p), disabled", &state, &__bss_end__, &end);
+    if (warm_start) LOG_INFO(logger, "Warm restart into phase %d, session %u", previous_resume.phase, previous_resume.file_index);
+    if (previous_valid) {
+      LOG_WARNING(logger, "Previous session %lu was up %lums, reason: %s", (unsigned long)state.boot_count, (unsigned long)state.uptime_ms,
+        state.reason[0] ? state.reason : ((reset_cause & PM_RCAUSE_WDT) ? "watchdog timeout" : "none recorded"));
+      const imu::Data& d = state.imu;
+      LOG_INFO(logger, "Last imu %d,%d,%d,%d,%d,%d,%d,%d,%d", d.ax, d.ay, d.az, d.gx, d.gy, d.gz, d.mx, d.my, d.mz);
+      LOG_INFO(logger, "Last gps %lu,%d,%s,%s,%s", (unsigned long)state.gga_time, state.fix, state.latitude, state.longitude, state.altitude);
+
+      // replay the ring from its oldest complete line
+      logger.println("Last log lines:");
+      int start = state.ring_wrapped ? state.ring_pos : 0;
+      int count = state.ring_wrapped ? ring_size : state.ring_pos;
+      bool skip_partial = state.ring_wrapped;
+      char line[101];
+      int len = 0;
+      for (int i=0; i<count; i++) {
+        char ch = state.ring[(start + i) % ring_size];
+        if (ch=='\n') {
+          if (!skip_partial) {
+            line[len] = 0;
+            logger.print("| ");
+            logger.println(line);
+          }
+          skip_partial = false;
+          len = 0;
+        } else if (len < (int)sizeof(line) - 1) {
+          line[len++] = ch;
+        }
+      }
+    } else {
+      logger.println("No record from a previous session");
+    }
+    startRecord(previous_valid ? state.boot_count + 1 : 0);
+  }
+
+  void update(unsigned long timestamp, unsigned long delta)
+  {
+    storeValue(state.uptime_ms, (uint32_t)timestamp);
+  }
+
+  void note(const char* line, int len)
+  {
+    if (!recording) return;
+    uint16_t pos = state.ring_pos;
+    uint8_t wrapped = state.ring_wrapped;
+    for (int i=0; i<=len; i++) {
+      char ch = i < len ? line[i] : '\n';
+      if (ch=='\r' || (ch=='\n' && i < len)) continue;
+      storeValue(state.ring[pos], ch);
+      if (++pos == ring_size) {
+        pos = 0;
+        wrapped = 1;
+      }
+    }
+    storeValue(state.ring_pos, pos);
+    storeValue(state.ring_wrapped, wrapped);
+  }
+
+  void setReason(const char* reason)
+  {
+    storeString(state.reason, sizeof(state.reason), reason);
+  }
+
+  void setImu(const imu::Data& data)
+  {
+    storeValue(state.imu, data);
+  }
+
+  void setGps(const gps::GpsData& data)
+  {
+    storeValue(state.gga_time, (uint32_t)data.gga_time);
+    storeValue(state.fix, (int16_t)data.fix);
+    storeString(state.latitude, sizeof(state.latitude), data.latitude.c_str());
+    storeString(state.longitude, sizeof(state.longitude), data.longitude.c_str());
+    storeString(state.altitude, sizeof(state.altitude), data.altitude.c_str());
+  }
+
+  bool previousValid()
+  {
+    return previous_valid;
+  }
+
+  uint32_t bootCount()
+  {
+    return state.boot_count;
+  }
+
+  bool warmStart()
+  {
+    return warm_start;
+  }
+
+  const Resume& resume()
+  {
+    return previous_resume;
+  }
+
+  void setRunning(bool running)
+  {
+    storeValue(state.resume.running, (uint8_t)running);
+  }
+
+  void setPhase(uint8_t phase)
+  {
+    storeValue(state.resume.phase, phase);
+  }
+
+  void setFileIndex(uint16_t index)
+  {
+    storeValue(state.resume.file_index, index);
+  }
+
+  void setMagAdjust(const uint16_t* mag_adjust)
+  {
+    store(state.resume.mag_adjust, mag_adjust, sizeof(state.resume.mag_adjust));
+  }
+
+  void setUplink(uint16_t seq, uint16_t head, uint16_t count)
+  {
+    storeValue(state.resume.uplink_seq, seq);
+    storeValue(state.resume.uplink_head, head);
+    storeValue(state.resume.uplink_count, count);
+  }
+}
+
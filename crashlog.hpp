@@ -0,0 +1,46 @@
+#pragma once
+#include "common.hpp"
+#include "imu.hpp"
+#include "gps.hpp"
+
+// A small record of the running session kept in RAM that survives a reset, so that after a
+// watchdog reboot or a hang the next boot can tell what happened: recent log lines, last sensor
+// values, why we rebooted and for how long we had been up. Everything is checksummed, so garbage
+// left in RAM after power-on is recognised and discarded.
+namespace crashlog
+{
+  // What a warm restart needs to carry on where the previous session stopped
+  struct Resume
+  {
+    uint8_t running;         // setup() had completed
+    uint8_t phase;           // flight::Phase
+    uint16_t file_index;     // flashlog session
+    uint16_t mag_adjust[3];  // AK8963 fuse ROM, only readable in bypass mode
+    uint16_t uplink_seq;     // next sample number, so the ground never sees one twice
+    uint16_t uplink_head;    // the part of the upload backlog spilled to UPL.BIN
+    uint16_t uplink_count;
+  };
+
+  void begin();  // first thing in setup(): validate what the previous session left
+  void report(); // once the log file is attached: write the previous session out, start a new record
+  void update(unsigned long timestamp, unsigned long delta);
+
+  void note(const char* line, int len); // a finished log line, '\r' and '\n' are dropped
+  void setReason(const char* reason);
+  void setImu(const imu::Data& data);
+  void setGps(const gps::GpsData& data);
+
+  bool previousValid();
+  uint32_t bootCount();
+
+  // A watchdog or requested reset out of a session that was up and running: peripherals are
+  // probably still configured, so setup() verifies them instead of starting over.
+  bool warmStart();
+  const Resume& resume(); // the previous session's, valid from begin() on
+  void setRunning(bool running);
+  void setPhase(uint8_t phase);
+  void setFileIndex(uint16_t index);
+  void setMagAdjust(const uint16_t* mag_adjust);
+  void setUplink(uint16_t seq, uint16_t head, uint16_t count);
+}
+
@@ -2,6 +2,7 @@
 #include "logging.hpp"
 #include "watchdog.hpp"
 #include <SD.h>
+#include <algorithm>
 
 
 // Set the pins used
@@ -10,54 +11,104 @@
 
 namespace flashlog
 {
-  Logger& logger = logging::get("flashlog");
+  Logger& logger = logging::get(logging::FLASHLOG);
+
+  // Sessions are not numbered out of a fixed range, so what limits them is the root directory:
+  // on FAT16 it is a fixed table of 512 entries, each session directory taking one
+  const int fat16_root_entries = 512;
 
   File logfile;
   File sensorfile;
   File gpsfile;
+  File uplinkfile;
+  int index_ = -1;
+#ifdef LOG_BINARY
+  File eventfile;
+#endif
 
-  void begin()
+  File open(const String& filename)
   {
-    pinMode(PIN_CS, OUTPUT);
-    if (!SD.begin(PIN_CS)) {
-      logger.println("Card init. failed!");
+    watchdog::tickle();
+    File file = SD.open(filename, FILE_WRITE); // appends if it exists
+    if (!file) {
+      LOG_ERROR(logger, "Could not create file %s", filename.c_str());
       assert(0);
     }
-    // generate log-file that doesn't already exist
-    
-    for (uint8_t i=0; i<100; i++) {
-      watchdog::tickle();
-      {
-        String filename = String("log")+String(i)+String(".txt");
-        if (SD.exists(filename)) continue;
-        logfile = SD.open(filename, FILE_WRITE);
-        if (!logfile) {
-          logger.println(String("Could not create file ") + filename);
-          assert(0);
-        }
-        logging::setLogfile(&logfile);
-      }
-      watchdog::tickle();
-      {
-        String filename = String("sen")+String(i)+String(".csv");
-        sensorfile = SD.open(filename, FILE_WRITE);
-        if (!sensorfile) {
-          logger.println(String("Could not create file ") + filename);
-          assert(0);
-        }
-      }
+    return file;
+  }
+
+  // Every session gets its own directory, LOGnnnnn, holding LOG.TXT, SEN.CSV, GPS.CSV, UPL.BIN
+  // (and EVT.BIN). resume: carry on with the files of a session that was interrupted.
+  void openSession(uint16_t i, bool resume)
+  {
+    index_ = i;
+    char dir[9];
+    snprintf(dir, sizeof(dir), "LOG%05u", i);
+    if (!SD.exists(dir) && !SD.mkdir(dir)) {
+      LOG_ERROR(logger, "Could not create directory %s; a FAT16 card holds at most %d files and directories in its root", dir, fat16_root_entries);
+      assert(0);
+    }
+    String prefix = String(dir) + "/";
+    logfile = open(prefix + "LOG.TXT");
+    logging::setLogfile(&logfile);
+#ifdef LOG_BINARY
+    eventfile = open(prefix + "EVT.BIN");
+    logging::setEventfile(&eventfile);
+#endif
+    sensorfile = open(prefix + "SEN.CSV");
+    gpsfile = open(prefix + "GPS.CSV");
+    // uplink overwrites slots in place, so not FILE_WRITE, which appends every write
+    uplinkfile = SD.open(prefix + "UPL.BIN", O_READ | O_WRITE | O_CREAT | (resume ? 0 : O_TRUNC));
+    if (!uplinkfile) LOG_WARNING(logger, "Could not open %sUPL.BIN", prefix.c_str());
+    watchdog::tickle();
+  }
+
+  // One pass over the root directory instead of an SD.exists() probe, itself a directory scan,
+  // per candidate index
+  uint16_t nextIndex()
+  {
+    int highest = -1;
+    int entries = 0;
+    File root = SD.open("/");
+    for (File entry = root.openNextFile(); entry; entry = root.openNextFile()) {
       watchdog::tickle();
-      {
-        String filename = String("gps")+String(i)+String(".csv");
-        gpsfile = SD.open(filename, FILE_WRITE);
-        if (!gpsfile) {
-          logger.println(String("Could not create file ") + filename);
-          assert(0);
-        }
+      entries++;
+      const char* name = entry.name();
+      if (entry.isDirectory() && strncmp(name, "LOG", 3)==0 && strlen(name)==8) {
+        bool digits = true;
+        for (int j=3; j<8; j++) digits = digits && isdigit(name[j]);
+        if (digits) highest = std::max(highest, atoi(name + 3));
       }
-      watchdog::tickle();
-      break;
+      entry.close();
     }
+    root.close();
+    if (entries >= fat16_root_entries - 16) LOG_WARNING(logger, "%d entries in the card's root, a FAT16 card stops at %d", entries, fat16_root_entries);
+    assert(highest < 0xffff);
+    return highest + 1;
+  }
+
+  void begin(int resume_index)
+  {
+    pinMode(PIN_CS, OUTPUT);
+    unsigned long t0 = micros();
+    if (!SD.begin(PIN_CS)) {
+      logger.println("Card init. failed!");
+      assert(0);
+    }
+    unsigned long t1 = micros();
+
+    // after a warm restart keep appending to the session we were writing
+    uint16_t i = resume_index >= 0 ? resume_index : nextIndex();
+    unsigned long t2 = micros();
+    openSession(i, resume_index >= 0);
+    unsigned long t3 = micros();
+
+    LOG_INFO(logger, "Session %u: card init %lums, index scan %lums, file open %lums", i, (t1 - t0) / 1000, (t2 - t1) / 1000, (t3 - t2) / 1000);
+  }
+
+  int index()
+  {
+    return index_;
   }
   
   File* sensorFile()
@@ -70,6 +121,11 @@ namespace flashlog
     return &gpsfile;
   }
 
+  File* uplinkFile()
+  {
+    return &uplinkfile;
+  }
+
   void flush()
   {
     watchdog::tickle();
@@ -79,6 +135,12 @@ namespace flashlog
     watchdog::tickle();
     gpsfile.flush();
     watchdog::tickle();
+    if (uplinkfile) uplinkfile.flush();
+    watchdog::tickle();
+#ifdef LOG_BINARY
+    eventfile.flush();
+    watchdog::tickle();
+#endif
   }
 }
 
@@ -3,11 +3,13 @@
 
 namespace flashlog
 {
-  void begin();
+  void begin(int resume_index = -1); // -1 starts a new session
+  int index(); // session number, the LOGnnnnn directory the files are in
   
   File* logFile();
   File* sensorFile();
   File* gpsFile();
+  File* uplinkFile(); // random access, not appended to
 
   void flush();
 }
@@ -0,0 +1,182 @@
+#include "flight.hpp"
+#include "logging.hpp"
+
+namespace flight
+{
+  Logger& logger = logging::get(logging::FLIGHT);
+
+  // The board is mounted with its z axis along the airframe, nose up: az reads +1 g on the pad.
+  const int32_t one_g = (int32_t)(1.f / imu::aRes);
+  const float g_per_lsb = imu::aRes;
+  const int32_t gyro_still = (int32_t)(10.f / imu::gRes); // 10 dps
+
+  const uint32_t launch_g2 = (3 * one_g) * (3 * one_g);             // |a| above 3 g ..
+  const unsigned long launch_hold_ms = 100;                        // .. for this long
+  const int32_t burnout_axial = one_g / 2;                         // axial below 0.5 g ..
+  const unsigned long burnout_hold_ms = 50;                        // .. for this long
+  const int32_t chute_axial = one_g * 7 / 10;                      // axial back above 0.7 g after burnout means we are hanging from something
+  const unsigned long chute_hold_ms = 500;
+  const float apogee_altitude_drop = 15.f;                         // m below the highest GPS fix
+  const unsigned long apogee_hold_ms = 1000;                       // keep the high rate a little past apogee
+  const uint32_t still_lo_g2 = (one_g * 9 / 10) * (one_g * 9 / 10); // |a| within 0.9 .. 1.1 g ..
+  const uint32_t still_hi_g2 = (one_g * 11 / 10) * (one_g * 11 / 10);
+  const unsigned long landed_hold_ms = 5000;                       // .. with no rotation for this long
+
+  const Rates phase_rates[] = {
+    { 1000,  5000, 10000 }, // PAD
+    {    0,  1000,  5000 }, // BOOST
+    {    0,  1000,  5000 }, // COAST
+    {    0,  1000,  5000 }, // APOGEE
+    {   50,  1000,  5000 }, // DESCENT
+    { 5000, 10000, 10000 }  // LANDED
+  };
+
+  // A condition has to hold continuously for some time before we act on it
+  class Hold
+  {
+    unsigned long since = 0;
+    bool holding = false;
+  public:
+    bool check(bool cond, unsigned long timestamp, unsigned long duration)
+    {
+      if (!cond) {
+        holding = false;
+        return false;
+      }
+      if (!holding) {
+        holding = true;
+        since = timestamp;
+      }
+      return timestamp - since >= duration;
+    }
+    void reset()
+    {
+      holding = false;
+    }
+  };
+
+  Phase phase_ = PAD;
+  unsigned long phase_timestamp = 0;
+  unsigned long launch_timestamp = 0;
+  Hold hold;
+
+  // vertical speed from integrating axial acceleration during powered and coasting flight;
+  // unknown after resuming mid-flight, as the integral up to the reset is lost
+  float velocity = 0.f;
+  bool velocity_known = false;
+  uint32_t last_us = 0;
+
+  unsigned long last_gga_time = 0;
+  float max_altitude = -1e9f;
+  float altitude = -1e9f;
+
+
+  const char* phaseName(Phase phase)
+  {
+    switch (phase) {
+      case PAD: return "pad";
+      case BOOST: return "boost";
+      case COAST: return "coast";
+      case APOGEE: return "apogee";
+      case DESCENT: return "descent";
+      case LANDED: return "landed";
+    }
+    return "?";
+  }
+
+  void enter(Phase phase, unsigned long timestamp)
+  {
+    if (launch_timestamp) LOG_INFO(logger, "Phase %s -> %s at %lums (T+%lums, v=%dm/s)", phaseName(phase_), phaseName(phase), timestamp, timestamp - launch_timestamp, (int)velocity);
+    else LOG_INFO(logger, "Phase %s -> %s at %lums", phaseName(phase_), phaseName(phase), timestamp);
+    phase_ = phase;
+    phase_timestamp = timestamp;
+    hold.reset();
+  }
+
+  void trackAltitude(const gps::GpsData& gps_data)
+  {
+    if (gps_data.gga_time == last_gga_time) return;
+    last_gga_time = gps_data.gga_time;
+    if (gps_data.fix <= 0 || gps_data.altitude == "NaN") return;
+    altitude = gps_data.altitude.toFloat();
+    if (altitude > max_altitude) max_altitude = altitude;
+  }
+
+  void update(unsigned long timestamp, const imu::Data& imu_data, const gps::GpsData& gps_data)
+  {
+    uint32_t now = imu::sampleTime(); // sample spacing, not loop jitter, is what integrates
+    float dt = last_us ? (now - last_us) * 1e-6f : 0.f;
+    if (dt > 0.05f) dt = 0.05f;
+    last_us = now;
+
+    trackAltitude(gps_data);
+
+    uint32_t a2 = imu::accelSquared(imu_data);
+    int32_t axial = imu_data.az;
+
+    switch (phase_) {
+      case PAD:
+        if (hold.check(a2 > launch_g2, timestamp, launch_hold_ms)) {
+          launch_timestamp = timestamp - launch_hold_ms;
+          velocity = 0.f;
+          velocity_known = true;
+          max_altitude = altitude;
+          enter(BOOST, timestamp);
+        }
+        break;
+
+      case BOOST:
+        velocity += (axial - one_g) * g_per_lsb * 9.81f * dt;
+        if (hold.check(axial < burnout_axial, timestamp, burnout_hold_ms)) enter(COAST, timestamp);
+        break;
+
+      case COAST:
+        velocity += (axial - one_g) * g_per_lsb * 9.81f * dt;
+        if ((velocity_known && velocity <= 0.f)
+          || (max_altitude > -1e9f && altitude < max_altitude - apogee_altitude_drop)
+          || hold.check(axial > chute_axial, timestamp, chute_hold_ms)) {
+          enter(APOGEE, timestamp);
+        }
+        break;
+
+      case APOGEE:
+        if (timestamp - phase_timestamp >= apogee_hold_ms) enter(DESCENT, timestamp);
+        break;
+
+      case DESCENT: {
+        bool still = a2 > still_lo_g2 && a2 < still_hi_g2
+          && abs(imu_data.gx) < gyro_still && abs(imu_data.gy) < gyro_still && abs(imu_data.gz) < gyro_still;
+        if (hold.check(still, timestamp, landed_hold_ms)) enter(LANDED, timestamp);
+        break;
+      }
+
+      case LANDED:
+        break;
+    }
+  }
+
+  void resume(Phase phase)
+  {
+    LOG_INFO(logger, "Resuming in phase %s", phaseName(phase));
+    phase_ = phase;
+    hold.reset();
+    velocity = 0.f;
+    velocity_known = false; // apogee then comes from the altitude and chute tests only
+  }
+
+  Phase phase()
+  {
+    return phase_;
+  }
+
+  const Rates& rates()
+  {
+    return phase_rates[phase_];
+  }
+
+  unsigned long launchTimestamp()
+  {
+    return launch_timestamp;
+  }
+}
+
@@ -0,0 +1,33 @@
+#pragma once
+#include "common.hpp"
+#include "imu.hpp"
+#include "gps.hpp"
+
+namespace flight
+{
+  enum Phase
+  {
+    PAD = 0,
+    BOOST,
+    COAST,
+    APOGEE,
+    DESCENT,
+    LANDED
+  };
+
+  // how often each stream is written to flash in the current phase; 0 means every sample
+  struct Rates
+  {
+    unsigned long sensor_log_ms;
+    unsigned long gps_log_ms;
+    unsigned long upload_ms;
+  };
+
+  void update(unsigned long timestamp, const imu::Data& imu_data, const gps::GpsData& gps_data); // once per IMU sample
+  void resume(Phase phase); // carry on in the phase we were in before a warm restart
+  Phase phase();
+  const char* phaseName(Phase phase);
+  const Rates& rates();
+  unsigned long launchTimestamp(); // 0 until launch is detected
+}
+
@@ -2,17 +2,18 @@
 #include "logging.hpp"
 #include "MySerial.hpp"
 #include "watchdog.hpp"
+#include "timebase.hpp"
 #include <functional>
 #include <cstring>
 
 namespace gps 
 {
-  Logger& logger = logging::get("gps");
+  Logger& logger = logging::get(logging::GPS);
 
 
   class GpsLayer0 {
   public:
-    MySerial serial = {"gps", true, false};
+    MySerial serial = {logging::GPS_TX, logging::GPS_RX, true, false};
   
     void beginL0() 
     {
@@ -31,10 +32,13 @@ namespace gps
   class GpsLayer1 : protected GpsLayer0
   {
     GpsData gps_data;
+    int32_t date_days = -1; // from RMC or ZDA; GGA only has the time of day
+    int32_t date_tod_ms = 0; // time of day in the sentence date_days came from
   public:
-    void beginL1() 
+    void beginL1(bool warm) 
     {
       beginL0();
+      if (warm) return; // the receiver keeps these settings for as long as the module stays powered
 
       logger.println("Activating aviation mode");
       if (!run(
@@ -43,7 +47,7 @@ namespace gps
            return rsp.startsWith("$PMTK001,886,3"); // *36
         }, 
         1000
-      )) logger.println("Warning: Failed to activate aviation mode");
+      )) LOG_WARNING(logger, "Failed to activate aviation mode");
       logger.println();
       watchdog::tickle();
 
@@ -54,7 +58,7 @@ namespace gps
            return rsp.startsWith("$PMTK001,257"); // *36
         }, 
         1000
-      )) logger.println("Warning: Failed to activate fast TTG when out of tunnel mode");
+      )) LOG_WARNING(logger, "Failed to activate fast TTG when out of tunnel mode");
       logger.println();
       watchdog::tickle();
     }
@@ -86,7 +90,7 @@ namespace gps
             } else if (unsolicitedMessageHandler(0, rsp)) {
               // it was an unrelated message; go on
             } else {
-              logger.println(String("Unknown response: \"") + rsp + "\"");
+              LOG_VERBOSE(logger, "Unknown response: \"%s\"", rsp.c_str());
             }
             watchdog::tickle();
           }
@@ -141,6 +145,29 @@ namespace gps
     }
 
 
+    // hhmmss.sss to milliseconds since midnight
+    static bool parseTimeOfDay(const String& hms, int32_t& ms)
+    {
+      if (hms.length() < 6) return false;
+      ms = (hms.substring(0, 2).toInt() * 3600 + hms.substring(2, 4).toInt() * 60 + hms.substring(4, 6).toInt()) * 1000;
+      int scale = 100;
+      for (int i=7; i<hms.length() && scale; i++, scale /= 10) ms += (hms[i] - '0') * scale;
+      return true;
+    }
+
+    // Sentences are stamped when we get to them, not when they arrived; timebase sorts that out
+    void setClock(int32_t days, int32_t tod_ms)
+    {
+      timebase::setUtc(timebase::now_us(), (uint64_t)days * 86400000 + tod_ms, timebase::UTC_GPS);
+    }
+
+    void setDate(int32_t days, int32_t tod_ms)
+    {
+      date_days = days;
+      date_tod_ms = tod_ms;
+      setClock(days, tod_ms);
+    }
+
     bool unsolicitedMessageHandler(unsigned long timestamp, const String& msg)
     {
       if (msg[0]!='$') return false; // not a command
@@ -156,17 +183,34 @@ namespace gps
         gps_data.latitude = parseNmeaCoord(toks[2], toks[3]);
         gps_data.longitude = parseNmeaCoord(toks[4], toks[5]);
         gps_data.altitude = (toks[10]=="M" && toks[9].length()>0) ? toks[9] : "NaN";
+        int32_t tod_ms;
+        if (gps_data.fix > 0 && date_days >= 0 && parseTimeOfDay(toks[1], tod_ms)) {
+          // past midnight before the next dated sentence
+          setClock(tod_ms < date_tod_ms - 43200000 ? date_days + 1 : date_days, tod_ms);
+        }
       } else if (sss=="ACCURACY") { // Accuracy
         gps_data.accuracy_time = timestamp;
         std::array<String, 2> toks;
         tokenizeNmea(msg, toks);
         gps_data.accuracy = toks[1];
       } else if (sss=="RMC") { // Time, date, position, course and speed data
+        std::array<String, 10> toks;
+        tokenizeNmea(msg, toks);
+        int32_t tod_ms;
+        if (toks[2]=="A" && toks[9].length()==6 && parseTimeOfDay(toks[1], tod_ms)) {
+          setDate(timebase::daysFromCivil(2000 + toks[9].substring(4, 6).toInt(), toks[9].substring(2, 4).toInt(), toks[9].substring(0, 2).toInt()), tod_ms);
+        }
       } else if (sss=="VTG") { // Course and speed information relative to the ground
       } else if (sss=="GLL") { // Geographic Position - Latitude/Longitude. Position was calculated based on one or more of the SVs having their states derived from almanac parameters, as opposed to ephemerides.
       } else if (sss=="GSA") { // GPS DOP and active satellite
       } else if (sss=="GSV") { // Satellites in view
       } else if (sss=="ZDA") { // Time & Date – UTC, Day, Month, Year and Local Time Zone
+        std::array<String, 5> toks;
+        tokenizeNmea(msg, toks);
+        int32_t tod_ms;
+        if (gps_data.fix > 0 && toks[4].length()==4 && parseTimeOfDay(toks[1], tod_ms)) { // without a fix this is the receiver's RTC
+          setDate(timebase::daysFromCivil(toks[4].toInt(), toks[3].toInt(), toks[2].toInt()), tod_ms);
+        }
       } else {
         return false; // Unknown sentence identifier
       }
@@ -187,7 +231,7 @@ namespace gps
       while (serial.hasString()) {
         String str = serial.popString();
         if (!unsolicitedMessageHandler(timestamp, str)) {
-          logger.println(String("Unhandled message: \"") + str + "\"");
+          LOG_VERBOSE(logger, "Unhandled message: \"%s\"", str.c_str());
         }
       }
     }      
@@ -195,9 +239,16 @@ namespace gps
     
     void prime(const String& lon /*10.418731*/, const String& lat /*63.415344*/, String date /*2016/11/13*/, String time_utc /*16:56:23*/)
     {
-      logger.println(String("Priming GPS with longitude ") + lon + " latitude " + lat + " date " + date + " time (UTC) " + time_utc);
+      LOG_INFO(logger, "Priming GPS with longitude %s latitude %s date %s time (UTC) %s", lon.c_str(), lat.c_str(), date.c_str(), time_utc.c_str());
 
       int default_altitude = 50;
+
+      // the network's idea of the time is good to a few seconds, which beats nothing until the GPS has a fix
+      if (date.length()==10 && time_utc.length()==8) {
+        int32_t days = timebase::daysFromCivil(date.substring(0, 4).toInt(), date.substring(5, 7).toInt(), date.substring(8, 10).toInt());
+        int32_t tod_ms = (time_utc.substring(0, 2).toInt() * 3600 + time_utc.substring(3, 5).toInt() * 60 + time_utc.substring(6, 8).toInt()) * 1000;
+        timebase::setUtc(timebase::now_us(), (uint64_t)days * 86400000 + tod_ms, timebase::UTC_GSM);
+      }
       
       // replace separators with ','
       for (int i=0; i<date.length(); i++) {
@@ -216,7 +267,7 @@ namespace gps
            return rsp.startsWith("$PMTK001,740"); 
         }, 
         1000
-      )) logger.println("Warning: Failed to prime GPS with time");
+      )) LOG_WARNING(logger, "Failed to prime GPS with time");
 
       // prime location
       if (!run(
@@ -225,7 +276,7 @@ namespace gps
            return rsp.startsWith("$PMTK001,741"); 
         }, 
         1000
-      )) logger.println("Warning: Failed to prime GPS with location");
+      )) LOG_WARNING(logger, "Failed to prime GPS with location");
       logger.println("Priming GPS done");
     }
   };
@@ -239,9 +290,9 @@ namespace gps
       updateL1(timestamp, delta);
     }
     
-    void begin()
+    void begin(bool warm)
     {
-      beginL1();
+      beginL1(warm);
     }
 
     using GpsLayer0::IrqHandler;
@@ -262,9 +313,9 @@ namespace gps
 {
   GpsFacade gps_obj;
   
-  void begin()
+  void begin(bool warm)
   {
-    gps_obj.begin();
+    gps_obj.begin(warm);
   }
 
   void update(unsigned long timestamp, unsigned long delta)
@@ -15,7 +15,7 @@ namespace gps
     String accuracy;
   };
   
-  void begin();
+  void begin(bool warm = false);
   void update(unsigned long timestamp, unsigned long delta);
   void prime(const String& lon, const String& lat, const String& date, const String& time_utc);
   const GpsData& get();
@@ -3,6 +3,7 @@
 #include "MySerial.hpp"
 #include "watchdog.hpp"
 #include <queue>
+#include <algorithm>
 
 // APN setup
 #define APN "data.lyca-mobile.no"
@@ -13,7 +14,7 @@
 
 namespace gsm
 {
-  Logger& logger = logging::get("gsm");
+  Logger& logger = logging::get(logging::GSM);
 
 
   class InitialRunnerImpl : public Runner
@@ -62,6 +63,8 @@ namespace gsm
     const String cmd;
     unsigned long timeout = 0;
     const std::function<Result(const String&, Runner* runner)> handler = nullptr;
+    std::vector<uint8_t> data; // written after the prompt
+    bool data_sent = false;
   public:
     CommandTask(const String& cmd, unsigned long timeout, std::function<Result(const String&, Runner*)> handler) 
       : Task(TYPE_COMMAND)
@@ -115,34 +118,93 @@ namespace gsm
     return new SyncTask(handler);
   }
 
+  Task* makeDataTask(const String& cmd, const uint8_t* data, size_t len, unsigned long timeout, std::function<Result(const String&, Runner*)> handler)
+  {
+    CommandTask* task = new CommandTask(cmd, timeout, handler);
+    task->data.assign(data, data + len);
+    return task;
+  }
+
 
   class GsmLayer0 {
+    // The module autobauds at power on, but autobauding is only reliable up to about 57600, so
+    // after the handshake it is told to switch to a fixed fast rate. The module remembers that
+    // across restarts and power cycles, so it has to be looked for at both.
+    const unsigned long autobaud_rate = 19200;
+    const unsigned long fast_rate = 115200;
+
+    bool probe(int tries)
+    {
+      serial.setTimeout(100);
+      for (int i = 0; i < tries; i++) {
+        serial.println("AT");
+        watchdog::tickle();
+        if (serial.find("OK\r")) return true;
+      }
+      return false;
+    }
+
+    // The module answers OK at the old rate and switches after that. If it cannot be heard at
+    // the new rate, go back; should it not be found there either, it did switch and the line
+    // does not carry the new rate, and the module has to be restarted.
+    bool switchBaud(unsigned long rate)
+    {
+      unsigned long old_rate = serial.baud();
+      LOG_INFO(logger, "Switching from %lu to %lu baud", old_rate, rate);
+      serial.setTimeout(200);
+      serial.println(String("AT+IPR=") + String(rate));
+      if (!serial.find("OK\r")) {
+        LOG_WARNING(logger, "Module refused %lu baud", rate);
+        return true;
+      }
+      serial.flush();
+      delay(20);
+      serial.setBaud(rate);
+      if (probe(3)) {
+        LOG_INFO(logger, "Now at %lu baud", rate);
+        return true;
+      }
+      LOG_WARNING(logger, "No answer at %lu baud, falling back to %lu", rate, old_rate);
+      serial.setBaud(old_rate);
+      if (probe(3)) return true;
+      LOG_ERROR(logger, "No answer at either rate");
+      return false;
+    }
+
   public:
-    MySerial serial = {"gsm", true, false};
+    MySerial serial = {logging::GSM_TX, logging::GSM_RX, true, false};
   
-    void beginL0() 
+    // warm: the module should still be up and configured from before a reset, so give it a
+    // few quick pokes and report failure instead of insisting
+    bool beginL0(bool warm) 
     {
       logger.println("Opening serial");
       watchdog::tickle();
-      serial.begin_hs(19200, 3ul/*PA09 SERCOM2.1 RX<-GSM_TX */, 4ul/*PA08 SERCOM2.0 TX->GSM_RX*/, 2ul /* RTS PA14 SERCOM2.2 */, 5ul /* CTS PA15 SERCOM2.3 */, PIO_SERCOM_ALT, PIO_SERCOM_ALT, PIO_DIGITAL, PIO_DIGITAL, SERCOM_RX_PAD_1, UART_TX_PAD_0, &sercom2);
+      serial.begin_hs(autobaud_rate, 3ul/*PA09 SERCOM2.1 RX<-GSM_TX */, 4ul/*PA08 SERCOM2.0 TX->GSM_RX*/, 2ul /* RTS PA14 SERCOM2.2 */, 5ul /* CTS PA15 SERCOM2.3 */, PIO_SERCOM_ALT, PIO_SERCOM_ALT, PIO_DIGITAL, PIO_DIGITAL, SERCOM_RX_PAD_1, UART_TX_PAD_0, &sercom2);
       watchdog::tickle();
     
       logger.println("Detecting baud");
       serial.setTimeout(100);
       for (int i = 0; i <= 10; i++) {
+        serial.setBaud(i % 2 ? fast_rate : autobaud_rate);
         serial.println("AT");
         watchdog::tickle();
         if (serial.find("OK\r")) break;
+        if (warm && i==2) {
+          logger.println("No answer, module needs a restart");
+          return false;
+        }
         assert(i < 10);
       }
       serial.setTimeout(1000);
       logger.println();
   
-      // Turn on flow control, disable echo, enable network status messages
+      // Turn on flow control, disable echo, enable network status messages, stay awake until told
+      // otherwise (after a warm restart the module may still have slow clock on)
       logger.println("Setup");
       serial.setTimeout(100);
       for (int i = 0; i <= 20; i++) {
-        serial.println("AT+IFC=2,2;E0;+CGREG=1");
+        serial.println("AT+IFC=2,2;E0;+CGREG=1;+CSCLK=0");
         if (serial.find("OK\r")) break;
         watchdog::tickle();
         assert(i < 10);
@@ -150,6 +212,12 @@ namespace gsm
       serial.setTimeout(1000);
       logger.println();
       watchdog::tickle();
+
+      // with flow control on, so nothing is lost if the switch goes wrong halfway
+      bool ok = serial.baud()==fast_rate || switchBaud(fast_rate);
+      serial.setTimeout(1000);
+      watchdog::tickle();
+      return ok;
     }    
 
     void updateL0() {}
@@ -167,6 +235,18 @@ namespace gsm
     std::queue<Task*> task_queue;
     CommandTask* current_task = nullptr;
 
+    // Slow clock sleep (AT+CSCLK=2): the modem goes to sleep by itself after 5 s without serial
+    // traffic and wakes on the next byte it receives, which it loses. So after a quiet spell, poke
+    // it with a bare "AT", drop whatever comes back and give it time to settle before the real command.
+    const unsigned long modem_idle_ms = 5000;
+    const unsigned long wake_ms = 100;
+    bool sleep_wanted = false;
+    bool may_sleep = false; // CSCLK=2 is or may be in effect
+    unsigned long last_activity = 0;
+    bool waking = false;
+    unsigned long waking_since = 0;
+    SleepStats sleep_stats;
+
 
 
     void startTask(Task* task, bool failed)
@@ -176,6 +256,7 @@ namespace gsm
       if (task->type==Task::TYPE_COMMAND && !failed) {
         current_task = (CommandTask*)task;
         watchdog::tickle();
+        last_activity = millis();
         serial.println(current_task->cmd);
         watchdog::tickle();
       } else if (task->type==Task::TYPE_COMMAND && failed) {
@@ -215,25 +296,35 @@ namespace gsm
 
     virtual bool unsolicitedMessageHandler(const String& msg) = 0;
   public:
-    void beginL1()
+    bool beginL1(bool warm)
     {
-      beginL0();
+      return beginL0(warm);
     }
     
     void updateL1(unsigned long timestamp, unsigned long delta)
     {   
       updateL0();
 
+      if (may_sleep && timestamp - last_activity > modem_idle_ms) sleep_stats.asleep_ms += delta;
       if (current_task && current_task->timeout > delta) current_task->timeout -= delta;
       else if (current_task) current_task->timeout = 0;
+
+      if (current_task && current_task->data.size() && !current_task->data_sent && serial.popPrompt('>')) {
+        serial.write(current_task->data.data(), current_task->data.size());
+        current_task->data_sent = true;
+        last_activity = timestamp;
+      }
       
       while (serial.hasString())
       {
         String str = serial.popString();
+        last_activity = timestamp;
         if (str.length()==0) {
           // ignore
         } else if (unsolicitedMessageHandler(str)) {
           // ok
+        } else if (waking) {
+          LOG_VERBOSE(logger, "Waking: \"%s\"", str.c_str());
         } else if (current_task) {
           Result res = current_task->handler(str, &current_task->runner);
           if (res==NOP) { /*keep running */ }
@@ -241,26 +332,64 @@ namespace gsm
           else if (res==ERROR) finishTask(true);
           else assert(!"Invalid handler result");
         } else if (current_task) {
-          logger.println(String("Unhandled: \"") + str + "\" running \"" + current_task->cmd + "\"");
+          LOG_VERBOSE(logger, "Unhandled: \"%s\" running \"%s\"", str.c_str(), current_task->cmd.c_str());
         } else {
-          logger.println(String("Unhandled: \"") + str + "\"");
+          LOG_VERBOSE(logger, "Unhandled: \"%s\"", str.c_str());
         }
       }
 
       if (current_task && current_task->timeout == 0) {
-        logger.println(String("Timeout running \"") + current_task->cmd + "\"");
+        LOG_WARNING(logger, "Timeout running \"%s\"", current_task->cmd.c_str());
         finishTask(true);
       }
 
-      if (!current_task && task_queue.size()) {
-        logger.println("Starting queued task");
-        startQueuedTask();
+      if (waking && timestamp - waking_since >= wake_ms) {
+        waking = false;
+        sleep_stats.wake_ms += timestamp - waking_since;
+        last_activity = timestamp;
+      }
+      if (!current_task && !waking && task_queue.size()) {
+        if (may_sleep && timestamp - last_activity > modem_idle_ms) {
+          last_activity = timestamp;
+          sleep_stats.wakes++;
+          waking = true;
+          waking_since = timestamp;
+          serial.println("AT");
+        } else {
+          logger.println("Starting queued task");
+          startQueuedTask();
+        }
       }
     }
 
+    void setSleep(bool enable)
+    {
+      if (enable == sleep_wanted) return;
+      sleep_wanted = enable;
+      LOG_INFO(logger, "Modem sleep %s", enable ? "on" : "off");
+      if (enable) may_sleep = true;
+      runner()->then(enable ? "AT+CSCLK=2" : "AT+CSCLK=0", 1000)->sync(
+        [this, enable](bool failed, Runner* r) {
+          if (!enable && !failed) may_sleep = false;
+          return NOP;
+        }
+      );
+    }
+
+    SleepStats takeSleepStats()
+    {
+      SleepStats stats = sleep_stats;
+      sleep_stats = SleepStats();
+      return stats;
+    }
+
     Runner* runner() {
       return &initial_runner;
     }
+
+    bool isIdle() {
+      return !current_task && !waking && task_queue.empty();
+    }
   };
   
   
@@ -277,19 +406,32 @@ namespace gsm
         "UNDER-VOLTAGE WARNNING", "OVER-VOLTAGE POWER DOWN", "OVER-VOLTAGE WARNING", "OVER-VOLTAGE WARNNING",
         "CHARGE-ONLY MODE", "RDY", "Call Ready", "SMS Ready", "+CFUN:", /*[<n>,]CONNECT OK*/ "CONNECT",
         /*[<n>,]CONNECT FAIL*/ /*[<n>,]ALREADY CONNECT*/ /*[<n>,]SEND OK*/ /*[<n>,]CLOSED*/ "RECV FROM:",
-        "RECV FROM:", "+IPD,", "+RECEIVE,", "REMOTE IP:", "+CDNSGIP:", "+PDP: DEACT", /*"+SAPBR",*/
+        "RECV FROM:", "+IPD,", "+RECEIVE,", "REMOTE IP:", "+CDNSGIP:", /*"+PDP: DEACT",*/ /*"+SAPBR",*/
         /*"+HTTPACTION:",*/ "+FTP", /*"+CGREG:",*/ "ALARM RING", "+CALV:"
       };
 
+      for (auto& handler : unsolicited_handlers) {
+        if (handler(msg)) return true;
+      }
       
       if (msg.startsWith("+CGREG: ")) {
         int status = msg.substring(8, 9).toInt();
         assert(status>=0);
-        //gsm_client.updateNetworkStatus(status==1 || status==5);
         bool old_status = gprs_status;
         this->gprs_status = (status==1 || status==5);
-        if (!old_status && gprs_status) maintainConnection();
-        else if (!gprs_status) connectionFailed();
+        if (!old_status && gprs_status) {
+          LOG_INFO(logger, "Registered");
+          retryNow();
+        } else if (!gprs_status) {
+          if (old_status) LOG_WARNING(logger, "Lost registration (%d)", status);
+          connectionFailed();
+        }
+        return true;
+      }
+
+      if (msg.startsWith("+PDP: DEACT")) {
+        LOG_WARNING(logger, "PDP context deactivated");
+        connectionFailed();
         return true;
       }
   
@@ -301,22 +443,69 @@ namespace gsm
   
   private:
     gsm::gps_priming_fn_t gps_priming_callback = nullptr;
+    std::vector<unsolicited_fn_t> unsolicited_handlers;
 
-    bool connected = false;
     bool gprs_status = false;
-
-    bool maintainConnectionRunning = false;
     long signal_strength = 0;
-  public:
 
-    bool isMaintainConnectionRunning() {
-      return maintainConnectionRunning;
+    // Connection state machine. +CGREG, +PDP: DEACT and failed uploads take the connection down
+    // as soon as they are seen and the first attempt to bring it back goes out right away; while
+    // attempts fail they back off exponentially. Signal and bearer are only polled while the
+    // modem has nothing else to do.
+    enum ConnState
+    {
+      CONN_DOWN,
+      CONN_CONNECTING,
+      CONN_UP
+    } conn_state = CONN_DOWN;
+    const unsigned long backoff_min_ms = 1000;
+    const unsigned long backoff_max_ms = 60000;
+    const unsigned long poll_ms = 30000;
+    unsigned long backoff_ms = backoff_min_ms;
+    unsigned long next_attempt = 0;
+    unsigned long last_poll = 0;
+    bool checking = false;
+    bool was_up = false;
+    unsigned long down_since = 0;
+    ConnectionStats conn_stats;
+
+    void retryNow()
+    {
+      backoff_ms = backoff_min_ms;
+      next_attempt = millis();
     }
-  
+
+    void attemptFailed()
+    {
+      conn_state = CONN_DOWN;
+      next_attempt = millis() + backoff_ms;
+      LOG_INFO(logger, "Failed to connect, retrying in %lums", backoff_ms);
+      backoff_ms = std::min(backoff_ms * 2, backoff_max_ms);
+    }
+
+    void connectionUp()
+    {
+      unsigned long now = millis();
+      if (conn_state!=CONN_UP && was_up) {
+        unsigned long took = now - down_since;
+        LOG_INFO(logger, "Reconnected after %lums", took);
+        conn_stats.reconnects++;
+        conn_stats.reconnect_ms += took;
+        conn_stats.max_reconnect_ms = std::max(conn_stats.max_reconnect_ms, took);
+      } else if (conn_state!=CONN_UP) {
+        LOG_INFO(logger, "Connected after %lums", now);
+      }
+      conn_state = CONN_UP;
+      was_up = true;
+      backoff_ms = backoff_min_ms;
+    }
+
+  public:
     void maintainConnection()
     {
       logger.println("Connection Maintenance");
-      maintainConnectionRunning = true;
+      checking = true;
+      last_poll = millis();
       
       runner()->then( // check signal and whether we need to set up bearer profile
         "AT+CSQ;+SAPBR=2,1", 10000, 
@@ -341,15 +530,16 @@ namespace gsm
         }
       )->sync( // conclude on whether we managed to connect
         [this](bool failed, Runner* r) {
-          maintainConnectionRunning = false;
-          if (failed) {
-            logger.println("Failed to connect.");
+          checking = false;
+          if (failed && conn_state==CONN_UP) {
             connectionFailed();
             return ERROR;
+          } else if (failed) {
+            attemptFailed();
+            return ERROR;
           } else {
-            logger.println("Connected.");
             gprs_status = true;
-            connected = true;
+            connectionUp();
             return OK;
           }
         }
@@ -377,21 +567,66 @@ namespace gsm
       );
     }
     
+    // a running attempt settles the state itself when it finishes
     void connectionFailed()
     {
-      if (connected) logger.println("Disconnected");
-      connected = false;
+      if (conn_state!=CONN_UP) return;
+      logger.println("Disconnected");
+      conn_state = CONN_DOWN;
+      down_since = millis();
+      conn_stats.drops++;
+      retryNow();
+    }
+
+    // check now rather than at the next poll, or retry now if down
+    void checkConnection()
+    {
+      if (conn_state==CONN_DOWN) retryNow();
+      else if (conn_state==CONN_UP && !checking) maintainConnection();
     }
       
-    void beginL2(gps_priming_fn_t gps_priming_callback) 
+    bool beginL2(gps_priming_fn_t gps_priming_callback, bool warm) 
     {
-      this->beginL1();
       this->gps_priming_callback = gps_priming_callback;
+      next_attempt = millis();
+      return this->beginL1(warm);
+    }
+
+    void updateL2(unsigned long timestamp, unsigned long delta)
+    {
+      updateL1(timestamp, delta);
+
+      if (conn_state==CONN_DOWN && !checking && (long)(timestamp - next_attempt) >= 0) {
+        conn_state = CONN_CONNECTING;
+        conn_stats.attempts++;
+        maintainConnection();
+      } else if (conn_state==CONN_UP && !checking && isIdle() && timestamp - last_poll >= poll_ms) {
+        maintainConnection();
+      }
     }
 
     bool isConnected()
     {
-      return connected;
+      return conn_state==CONN_UP;
+    }
+
+    long signalStrength()
+    {
+      return signal_strength;
+    }
+
+    ConnectionStats takeConnectionStats()
+    {
+      ConnectionStats stats = conn_stats;
+      conn_stats = ConnectionStats();
+      stats.down_ms = conn_state==CONN_UP ? 0 : millis() - down_since;
+      stats.signal = signal_strength;
+      return stats;
+    }
+
+    void addUnsolicitedHandler(unsolicited_fn_t handler)
+    {
+      unsolicited_handlers.push_back(handler);
     }
     
   };
@@ -400,14 +635,14 @@ namespace gsm
   class GsmFacade : protected GsmLayer2
   {
   public:
-    void begin(gps_priming_fn_t gps_priming_callback) 
+    bool begin(gps_priming_fn_t gps_priming_callback, bool warm) 
     {
-      this->beginL2(gps_priming_callback);
+      return this->beginL2(gps_priming_callback, warm);
     }
 
     void update(unsigned long timestamp, unsigned long delta)
     {
-      updateL1(timestamp, delta);
+      updateL2(timestamp, delta);
 
       while (Serial.available()) {
         serial.write(Serial.read());
@@ -415,11 +650,15 @@ namespace gsm
     }
 
     using GsmLayer1::runner;
+    using GsmLayer1::setSleep;
+    using GsmLayer1::takeSleepStats;
     using GsmLayer0::IrqHandler;
     using GsmLayer2::isConnected;
     using GsmLayer2::connectionFailed;
-    using GsmLayer2::maintainConnection;
-    using GsmLayer2::isMaintainConnectionRunning;
+    using GsmLayer2::checkConnection;
+    using GsmLayer2::takeConnectionStats;
+    using GsmLayer2::signalStrength;
+    using GsmLayer2::addUnsolicitedHandler;
   };
 
 
@@ -430,9 +669,9 @@ namespace gsm
 {
   GsmFacade gsm_obj;
   
-  void begin(gps_priming_fn_t gps_priming_callback)
+  bool begin(gps_priming_fn_t gps_priming_callback, bool warm)
   {
-    gsm_obj.begin(gps_priming_callback);
+    return gsm_obj.begin(gps_priming_callback, warm);
   }
 
   void update(unsigned long timestamp, unsigned long delta)
@@ -452,13 +691,54 @@ namespace gsm
 
   void maintainConnection()
   {
-    if (!gsm_obj.isMaintainConnectionRunning()) gsm_obj.maintainConnection();
+    gsm_obj.checkConnection();
+  }
+
+  long signalStrength()
+  {
+    return gsm_obj.signalStrength();
   }
   
   Runner* runner()
   {
     return gsm_obj.runner();
   }
+
+  void setSleep(bool enable)
+  {
+    gsm_obj.setSleep(enable);
+  }
+
+  const char* apn()
+  {
+    return APN;
+  }
+
+  void addUnsolicitedHandler(unsolicited_fn_t handler)
+  {
+    gsm_obj.addUnsolicitedHandler(handler);
+  }
+
+  // SIM800 datasheet: ~15 mA idle and registered, ~1 mA in slow clock sleep
+  const unsigned long idle_ma10 = 150;
+  const unsigned long sleep_ma10 = 10;
+  unsigned long last_report = 0;
+
+  void report()
+  {
+    unsigned long now = millis();
+    unsigned long span = now - last_report;
+    last_report = now;
+    SleepStats stats = gsm_obj.takeSleepStats();
+    if (!span) return;
+    if (stats.asleep_ms > span) stats.asleep_ms = span;
+    unsigned long saved_ma10 = (unsigned long)((uint64_t)stats.asleep_ms * (idle_ma10 - sleep_ma10) / span);
+    LOG_INFO(logger, "Modem asleep %lu%% of %lus, about %lu.%lumA saved; %lu wakes added %lums", stats.asleep_ms * 100 / span, span / 1000, saved_ma10 / 10, saved_ma10 % 10, stats.wakes, stats.wake_ms);
+
+    ConnectionStats conn = gsm_obj.takeConnectionStats();
+    LOG_INFO(logger, "Signal %ld, %s; %lu drops, %lu attempts, %lu reconnects taking %lums on average and %lums at most",
+      conn.signal, conn.down_ms ? "down" : "up", conn.drops, conn.attempts, conn.reconnects, conn.reconnects ? conn.reconnect_ms / conn.reconnects : 0UL, conn.max_reconnect_ms);
+  }
 }
 
 
@@ -1,15 +1,45 @@
 #pragma once
 #include "common.hpp"
 #include <functional>
+#include <vector>
 
 namespace gsm
 {
   using gps_priming_fn_t = std::function<void(const String& lon, const String& lat, const String& date, const String& time_utc)>;
-  void begin(gps_priming_fn_t gps_priming_callback);
+  bool begin(gps_priming_fn_t gps_priming_callback, bool warm = false); // warm: only check the module still answers
   void update(unsigned long timestamp, unsigned long delta);
   bool isConnected();
-  void connectionFailed();
-  void maintainConnection();
+  void connectionFailed(); // an upload failed in a way that points at the connection
+  void maintainConnection(); // check signal and bearer now instead of at the next idle poll
+  long signalStrength(); // +CSQ from the last poll: 0..31, 99 when unknown
+
+  struct ConnectionStats
+  {
+    unsigned long drops = 0;
+    unsigned long attempts = 0;
+    unsigned long reconnects = 0;
+    unsigned long reconnect_ms = 0;     // summed over reconnects, from the drop to being up again
+    unsigned long max_reconnect_ms = 0;
+    unsigned long down_ms = 0;          // 0 while up
+    long signal = 0;                    // +CSQ, 0..31
+  };
+
+  // Let the modem sleep between commands (AT+CSCLK=2); each command after a quiet spell then waits
+  // ~100 ms for it to wake up
+  struct SleepStats
+  {
+    unsigned long wakes = 0;
+    unsigned long wake_ms = 0;   // latency added to commands by waking
+    unsigned long asleep_ms = 0; // estimated: quiet time beyond the modem's 5 s idle timeout
+  };
+  void setSleep(bool enable);
+  void report();
+
+  const char* apn();
+
+  // Sees every line from the modem before anything else does; return true to consume it
+  using unsolicited_fn_t = std::function<bool(const String& msg)>;
+  void addUnsolicitedHandler(unsolicited_fn_t handler);
 
 
 
@@ -25,6 +55,7 @@ namespace gsm
 
   Task* makeCommandTask(const String& cmd, unsigned long timeout, std::function<Result(const String&, Runner*)> handler);
   Task* makeSyncTask(std::function<Result(bool failed, Runner*)> handler);
+  Task* makeDataTask(const String& cmd, const uint8_t* data, size_t len, unsigned long timeout, std::function<Result(const String&, Runner*)> handler);
 
   
   class Runner
@@ -39,6 +70,11 @@ namespace gsm
     {
       return thenGeneral(makeSyncTask(handler));
     }
+    // like then(), but data is written raw once the modem prompts for it with "> " (AT+CIPSEND)
+    Runner* thenData(const String& cmd, const uint8_t* data, size_t len, unsigned long timeout, std::function<Result(const String&, Runner*)> handler=nullptr)
+    {
+      return thenGeneral(makeDataTask(cmd, data, len, timeout, handler));
+    }
   };
 
   Runner* runner();
@@ -4,7 +4,7 @@
 
 namespace http
 {
-  Logger& logger = logging::get("http");
+  Logger& logger = logging::get(logging::HTTP);
 
   using namespace gsm;
 
@@ -0,0 +1,265 @@
+#include "i2c.hpp"
+#include "logging.hpp"
+#include "watchdog.hpp"
+#include <Wire.h>
+
+namespace i2c
+{
+  Logger& logger = logging::get(logging::I2C);
+
+  const uint8_t dma_channel = 0;
+  const unsigned long phase_timeout_us = 1000;   // address + register byte, normally ~50 us
+  const unsigned long transfer_timeout_us = 5000; // whole transaction, normally < 1 ms
+
+  __attribute__((__aligned__(16))) DmacDescriptor descriptors[dma_channel + 1];
+  __attribute__((__aligned__(16))) DmacDescriptor writeback[dma_channel + 1];
+
+  struct Transaction
+  {
+    uint8_t address;
+    uint8_t subAddress;
+    uint8_t count;
+    uint8_t* dest;
+    done_fn_t done;
+  };
+
+  const int queue_size = 4;
+  Transaction queue[queue_size];
+  volatile int queue_head = 0;
+  volatile int queue_len = 0;
+  volatile bool active = false;   // head transaction owns the bus
+  volatile bool aborted = false;  // head transaction timed out and the bus was recovered
+  volatile unsigned long started_us = 0;
+
+  unsigned long scl_hz = 400000;
+  Stats stats_;
+
+
+  void initBus()
+  {
+    Wire.begin(); // pin muxing and master mode with smart mode enabled
+    sercom3.disableWIRE();
+    SERCOM3->I2CM.BAUD.bit.BAUD = SystemCoreClock / (2 * scl_hz) - 1;
+    sercom3.enableWIRE();
+  }
+
+  void initDma()
+  {
+    PM->AHBMASK.reg |= PM_AHBMASK_DMAC;
+    PM->APBBMASK.reg |= PM_APBBMASK_DMAC;
+
+    // The descriptor tables can only be moved with the DMAC disabled; only our own channel is reset
+    DMAC->CTRL.bit.DMAENABLE = 0;
+    DMAC->BASEADDR.reg = (uint32_t)descriptors;
+    DMAC->WRBADDR.reg = (uint32_t)writeback;
+    DMAC->CTRL.reg |= DMAC_CTRL_DMAENABLE | DMAC_CTRL_LVLEN(0xf);
+
+    DMAC->CHID.reg = DMAC_CHID_ID(dma_channel);
+    DMAC->CHCTRLA.reg &= ~DMAC_CHCTRLA_ENABLE;
+    DMAC->CHCTRLA.reg = DMAC_CHCTRLA_SWRST;
+    while (DMAC->CHCTRLA.reg & DMAC_CHCTRLA_SWRST);
+    DMAC->CHCTRLB.reg = DMAC_CHCTRLB_LVL(0) | DMAC_CHCTRLB_TRIGSRC(SERCOM3_DMAC_ID_RX) | DMAC_CHCTRLB_TRIGACT_BEAT;
+    DMAC->CHINTENSET.reg = DMAC_CHINTENSET_TCMPL | DMAC_CHINTENSET_TERR;
+
+    NVIC_SetPriority(DMAC_IRQn, 1);
+    NVIC_EnableIRQ(DMAC_IRQn);
+  }
+
+  void stopDma()
+  {
+    DMAC->CHID.reg = DMAC_CHID_ID(dma_channel);
+    DMAC->CHCTRLA.reg &= ~DMAC_CHCTRLA_ENABLE;
+    DMAC->CHINTFLAG.reg = DMAC_CHINTFLAG_TCMPL | DMAC_CHINTFLAG_TERR;
+  }
+
+  void stopBus()
+  {
+    SERCOM3->I2CM.CTRLB.bit.CMD = 3; // STOP
+    while (SERCOM3->I2CM.SYNCBUSY.bit.SYSOP);
+  }
+
+  bool waitMasterOnBus(unsigned long start)
+  {
+    while (!SERCOM3->I2CM.INTFLAG.bit.MB) {
+      if (SERCOM3->I2CM.STATUS.bit.BUSERR || micros() - start > phase_timeout_us) return false;
+    }
+    return !SERCOM3->I2CM.STATUS.bit.RXNACK;
+  }
+
+  // Clock out the slave address and register pointer, then hand the read over to the DMAC.
+  // With ADDR.LENEN the SERCOM NACKs the last byte and issues STOP on its own.
+  // Polls for up to phase_timeout_us, so it only runs from the DMAC interrupt with interrupts enabled.
+  bool start(const Transaction& t)
+  {
+    unsigned long start = micros();
+    while (SERCOM3->I2CM.STATUS.bit.BUSSTATE != 1 /*IDLE*/ && SERCOM3->I2CM.STATUS.bit.BUSSTATE != 2 /*OWNER*/) {
+      if (micros() - start > phase_timeout_us) return false;
+    }
+
+    SERCOM3->I2CM.ADDR.reg = SERCOM_I2CM_ADDR_ADDR(t.address << 1);
+    while (SERCOM3->I2CM.SYNCBUSY.bit.SYSOP);
+    if (!waitMasterOnBus(start)) {
+      stopBus();
+      return false;
+    }
+    SERCOM3->I2CM.DATA.reg = t.subAddress;
+    while (SERCOM3->I2CM.SYNCBUSY.bit.SYSOP);
+    if (!waitMasterOnBus(start)) {
+      stopBus();
+      return false;
+    }
+
+    DmacDescriptor& d = descriptors[dma_channel];
+    d.BTCTRL.reg = DMAC_BTCTRL_VALID | DMAC_BTCTRL_BEATSIZE_BYTE | DMAC_BTCTRL_DSTINC | DMAC_BTCTRL_BLOCKACT_NOACT;
+    d.BTCNT.reg = t.count;
+    d.SRCADDR.reg = (uint32_t)&SERCOM3->I2CM.DATA.reg;
+    d.DSTADDR.reg = (uint32_t)(t.dest + t.count); // end address when incrementing
+    d.DESCADDR.reg = 0;
+    DMAC->CHID.reg = DMAC_CHID_ID(dma_channel);
+    DMAC->CHCTRLA.reg |= DMAC_CHCTRLA_ENABLE;
+
+    SERCOM3->I2CM.ADDR.reg = SERCOM_I2CM_ADDR_ADDR(t.address << 1 | 1) | SERCOM_I2CM_ADDR_LENEN | SERCOM_I2CM_ADDR_LEN(t.count); // repeated start
+    while (SERCOM3->I2CM.SYNCBUSY.bit.SYSOP);
+    return true;
+  }
+
+  // Complete the head transaction
+  void finish(bool ok)
+  {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    Transaction t = queue[queue_head];
+    queue_head = (queue_head + 1) % queue_size;
+    queue_len--;
+    active = false;
+    aborted = false;
+    __set_PRIMASK(primask);
+
+    stats_.transactions++;
+    if (!ok) stats_.failures++;
+    if (t.done) t.done(ok);
+  }
+
+  // Start queued transactions until one is on the bus or the queue is empty
+  void startNext()
+  {
+    for (;;) {
+      uint32_t primask = __get_PRIMASK();
+      __disable_irq();
+      if (active || !queue_len) {
+        __set_PRIMASK(primask);
+        return;
+      }
+      Transaction t = queue[queue_head];
+      active = true;
+      started_us = micros();
+      __set_PRIMASK(primask);
+
+      if (start(t)) return;
+      finish(false);
+    }
+  }
+
+  // Everything that touches the bus runs here. readAsync() pends this interrupt rather than
+  // starting a transaction itself, so the EIC interrupt above us never waits on the bus, and
+  // interrupts stay enabled for it while start() polls.
+  void dmaIrqHandler()
+  {
+    DMAC->CHID.reg = DMAC_CHID_ID(dma_channel);
+    uint8_t flags = DMAC->CHINTFLAG.reg;
+    DMAC->CHINTFLAG.reg = flags;
+    if (active) {
+      if (aborted || (flags & DMAC_CHINTFLAG_TERR)) finish(false);
+      else if (flags & DMAC_CHINTFLAG_TCMPL) finish(true);
+    }
+    startNext();
+  }
+
+
+  void begin(unsigned long scl_hz)
+  {
+    i2c::scl_hz = scl_hz;
+    initBus();
+    initDma();
+  }
+
+  bool readAsync(uint8_t address, uint8_t subAddress, uint8_t count, uint8_t* dest, done_fn_t done)
+  {
+    assert(dest && count);
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (queue_len==queue_size) {
+      __set_PRIMASK(primask);
+      return false;
+    }
+    queue[(queue_head + queue_len) % queue_size] = {address, subAddress, count, dest, done};
+    queue_len++;
+    if (!active) NVIC_SetPendingIRQ(DMAC_IRQn);
+    __set_PRIMASK(primask);
+    return true;
+  }
+
+  bool isBusy()
+  {
+    return queue_len > 0;
+  }
+
+  // Free a slave that holds SDA low mid-byte by clocking SCL until it lets go, then issue a STOP
+  // and bring the SERCOM back up.
+  void recover()
+  {
+    stats_.recoveries++;
+    stopDma();
+    sercom3.disableWIRE();
+
+    pinMode(PIN_WIRE_SDA, INPUT_PULLUP);
+    pinMode(PIN_WIRE_SCL, OUTPUT);
+    for (int i=0; i<9 && !digitalRead(PIN_WIRE_SDA); i++) {
+      digitalWrite(PIN_WIRE_SCL, LOW);
+      delayMicroseconds(5);
+      digitalWrite(PIN_WIRE_SCL, HIGH);
+      delayMicroseconds(5);
+    }
+    pinMode(PIN_WIRE_SDA, OUTPUT);
+    digitalWrite(PIN_WIRE_SDA, LOW);
+    delayMicroseconds(5);
+    digitalWrite(PIN_WIRE_SCL, HIGH);
+    delayMicroseconds(5);
+    digitalWrite(PIN_WIRE_SDA, HIGH);
+    delayMicroseconds(5);
+
+    initBus();
+    SERCOM3->I2CM.STATUS.bit.BUSSTATE = 1; // force IDLE
+    while (SERCOM3->I2CM.SYNCBUSY.bit.SYSOP);
+  }
+
+  // The transaction stays active while the bus is recovered, so the DMAC interrupt leaves the
+  // bus alone until it is told to fail it
+  void update(unsigned long timestamp, unsigned long delta)
+  {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    bool timed_out = active && !aborted && micros() - started_us > transfer_timeout_us;
+    if (timed_out) stopDma();
+    __set_PRIMASK(primask);
+    if (!timed_out) return;
+
+    stats_.timeouts++;
+    recover();
+    aborted = true;
+    NVIC_SetPendingIRQ(DMAC_IRQn);
+    LOG_WARNING(logger, "Transaction timed out, bus recovered (%lu timeouts)", stats_.timeouts);
+  }
+
+  const Stats& stats()
+  {
+    return stats_;
+  }
+}
+
+
+void DMAC_Handler()
+{
+  i2c::dmaIrqHandler();
+}
+
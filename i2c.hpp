@@ -0,0 +1,28 @@
+#pragma once
+#include "common.hpp"
+
+// Queued register reads on the SERCOM3 I2C bus, with the data phase moved by DMA.
+// Only the one-byte register address is clocked out by the CPU (~50 us at 400 kHz); the
+// read itself runs in the background and completes in the DMAC interrupt.
+namespace i2c
+{
+  using done_fn_t = void (*)(bool ok); // called from the DMAC interrupt, which the EIC can preempt; keep it short
+
+  struct Stats
+  {
+    unsigned long transactions = 0;
+    unsigned long failures = 0;  // address/register NACK or bus error
+    unsigned long timeouts = 0;
+    unsigned long recoveries = 0;
+  };
+
+  void begin(unsigned long scl_hz = 400000);
+  void update(unsigned long timestamp, unsigned long delta);
+
+  bool readAsync(uint8_t address, uint8_t subAddress, uint8_t count, uint8_t* dest, done_fn_t done);
+  bool isBusy();
+  void recover();
+
+  const Stats& stats();
+}
+
@@ -1,279 +1,102 @@
 #include "imu.hpp"
 #include "logging.hpp"
 #include <Wire.h>
-
-#define PIN_MPU_INT 27
-#define LoggerDebug false  // set to true to get Serial output for debugging
-
-
-// See also MPU-9250 Register Map and Descriptions, Revision 4.0, RM-MPU-9250A-00, Rev. 1.4, 9/9/2013 for registers not listed in
-// above document; the MPU9250 and MPU9150 are virtually identical but the latter has a different register map
-//
-//Magnetometer Registers
-#define AK8963_ADDRESS   0x0C
-#define WHO_AM_I_AK8963  0x00 // should return 0x48
-#define INFO             0x01
-#define AK8963_ST1       0x02  // data ready status bit 0
-#define AK8963_XOUT_L   0x03  // data
-#define AK8963_XOUT_H  0x04
-#define AK8963_YOUT_L  0x05
-#define AK8963_YOUT_H  0x06
-#define AK8963_ZOUT_L  0x07
-#define AK8963_ZOUT_H  0x08
-#define AK8963_ST2       0x09  // Data overflow bit 3 and data read error status bit 2
-#define AK8963_CNTL      0x0A  // Power down (0000), single-measurement (0001), self-test (1000) and Fuse ROM (1111) modes on bits 3:0
-#define AK8963_ASTC      0x0C  // Self test control
-#define AK8963_I2CDIS    0x0F  // I2C disable
-#define AK8963_ASAX      0x10  // Fuse ROM x-axis sensitivity adjustment value
-#define AK8963_ASAY      0x11  // Fuse ROM y-axis sensitivity adjustment value
-#define AK8963_ASAZ      0x12  // Fuse ROM z-axis sensitivity adjustment value
-
-#define SELF_TEST_X_GYRO 0x00
-#define SELF_TEST_Y_GYRO 0x01
-#define SELF_TEST_Z_GYRO 0x02
-
-/*#define X_FINE_GAIN      0x03 // [7:0] fine gain
-  #define Y_FINE_GAIN      0x04
-  #define Z_FINE_GAIN      0x05
-  #define XA_OFFSET_H      0x06 // User-defined trim values for accelerometer
-  #define XA_OFFSET_L_TC   0x07
-  #define YA_OFFSET_H      0x08
-  #define YA_OFFSET_L_TC   0x09
-  #define ZA_OFFSET_H      0x0A
-  #define ZA_OFFSET_L_TC   0x0B */
-
-#define SELF_TEST_X_ACCEL 0x0D
-#define SELF_TEST_Y_ACCEL 0x0E
-#define SELF_TEST_Z_ACCEL 0x0F
-
-#define SELF_TEST_A      0x10
-
-#define XG_OFFSET_H      0x13  // User-defined trim values for gyroscope
-#define XG_OFFSET_L      0x14
-#define YG_OFFSET_H      0x15
-#define YG_OFFSET_L      0x16
-#define ZG_OFFSET_H      0x17
-#define ZG_OFFSET_L      0x18
-#define SMPLRT_DIV       0x19
-#define CONFIG           0x1A
-#define GYRO_CONFIG      0x1B
-#define ACCEL_CONFIG     0x1C
-#define ACCEL_CONFIG2    0x1D
-#define LP_ACCEL_ODR     0x1E
-#define WOM_THR          0x1F
-
-#define MOT_DUR          0x20  // Duration counter threshold for motion interrupt generation, 1 kHz rate, LSB = 1 ms
-#define ZMOT_THR         0x21  // Zero-motion detection threshold bits [7:0]
-#define ZRMOT_DUR        0x22  // Duration counter threshold for zero motion interrupt generation, 16 Hz rate, LSB = 64 ms
-
-#define FIFO_EN          0x23
-#define I2C_MST_CTRL     0x24
-#define I2C_SLV0_ADDR    0x25
-#define I2C_SLV0_REG     0x26
-#define I2C_SLV0_CTRL    0x27
-#define I2C_SLV1_ADDR    0x28
-#define I2C_SLV1_REG     0x29
-#define I2C_SLV1_CTRL    0x2A
-#define I2C_SLV2_ADDR    0x2B
-#define I2C_SLV2_REG     0x2C
-#define I2C_SLV2_CTRL    0x2D
-#define I2C_SLV3_ADDR    0x2E
-#define I2C_SLV3_REG     0x2F
-#define I2C_SLV3_CTRL    0x30
-#define I2C_SLV4_ADDR    0x31
-#define I2C_SLV4_REG     0x32
-#define I2C_SLV4_DO      0x33
-#define I2C_SLV4_CTRL    0x34
-#define I2C_SLV4_DI      0x35
-#define I2C_MST_STATUS   0x36
-#define INT_PIN_CFG      0x37
-#define INT_ENABLE       0x38
-#define DMP_INT_STATUS   0x39  // Check DMP interrupt
-#define INT_STATUS       0x3A
-#define ACCEL_XOUT_H     0x3B
-#define ACCEL_XOUT_L     0x3C
-#define ACCEL_YOUT_H     0x3D
-#define ACCEL_YOUT_L     0x3E
-#define ACCEL_ZOUT_H     0x3F
-#define ACCEL_ZOUT_L     0x40
-#define TEMP_OUT_H       0x41
-#define TEMP_OUT_L       0x42
-#define GYRO_XOUT_H      0x43
-#define GYRO_XOUT_L      0x44
-#define GYRO_YOUT_H      0x45
-#define GYRO_YOUT_L      0x46
-#define GYRO_ZOUT_H      0x47
-#define GYRO_ZOUT_L      0x48
-#define EXT_SENS_DATA_00 0x49
-#define EXT_SENS_DATA_01 0x4A
-#define EXT_SENS_DATA_02 0x4B
-#define EXT_SENS_DATA_03 0x4C
-#define EXT_SENS_DATA_04 0x4D
-#define EXT_SENS_DATA_05 0x4E
-#define EXT_SENS_DATA_06 0x4F
-#define EXT_SENS_DATA_07 0x50
-#define EXT_SENS_DATA_08 0x51
-#define EXT_SENS_DATA_09 0x52
-#define EXT_SENS_DATA_10 0x53
-#define EXT_SENS_DATA_11 0x54
-#define EXT_SENS_DATA_12 0x55
-#define EXT_SENS_DATA_13 0x56
-#define EXT_SENS_DATA_14 0x57
-#define EXT_SENS_DATA_15 0x58
-#define EXT_SENS_DATA_16 0x59
-#define EXT_SENS_DATA_17 0x5A
-#define EXT_SENS_DATA_18 0x5B
-#define EXT_SENS_DATA_19 0x5C
-#define EXT_SENS_DATA_20 0x5D
-#define EXT_SENS_DATA_21 0x5E
-#define EXT_SENS_DATA_22 0x5F
-#define EXT_SENS_DATA_23 0x60
-#define MOT_DETECT_STATUS 0x61
-#define I2C_SLV0_DO      0x63
-#define I2C_SLV1_DO      0x64
-#define I2C_SLV2_DO      0x65
-#define I2C_SLV3_DO      0x66
-#define I2C_MST_DELAY_CTRL 0x67
-#define SIGNAL_PATH_RESET  0x68
-#define MOT_DETECT_CTRL  0x69
-#define USER_CTRL        0x6A  // Bit 7 enable DMP, bit 3 reset DMP
-#define PWR_MGMT_1       0x6B // Device defaults to the SLEEP mode
-#define PWR_MGMT_2       0x6C
-#define DMP_BANK         0x6D  // Activates a specific bank in the DMP
-#define DMP_RW_PNT       0x6E  // Set read/write pointer to a specific start address in specified DMP bank
-#define DMP_REG          0x6F  // Register in DMP from which to read or to which to write
-#define DMP_REG_1        0x70
-#define DMP_REG_2        0x71
-#define FIFO_COUNTH      0x72
-#define FIFO_COUNTL      0x73
-#define FIFO_R_W         0x74
-#define WHO_AM_I_MPU9250 0x75 // Should return 0x71
-#define XA_OFFSET_H      0x77
-#define XA_OFFSET_L      0x78
-#define YA_OFFSET_H      0x7A
-#define YA_OFFSET_L      0x7B
-#define ZA_OFFSET_H      0x7D
-#define ZA_OFFSET_L      0x7E
-
-// Using the MPU9250Teensy 3.1 Add-On shield, ADO is set to 0
-// Seven-bit device address is 110100 for ADO = 0 and 110101 for ADO = 1
-#define ADO 0
-#if ADO
-#define MPU9250_ADDRESS 0x69  // Device address when ADO = 1
-#define AK8963_ADDRESS 0x0C   //  Address of magnetometer
-//#define MS5637_ADDRESS 0x76   // Address of altimeter
+#include "mpu9250.hpp"
+#include "i2c.hpp"
+#include "ahrs.hpp"
+#include "timebase.hpp"
+#include "SpscQueue.hpp"
+#ifdef IMU_SIM
+#include "imusim.hpp"
+#define IMU_WIRE imusim::wire
 #else
-#define MPU9250_ADDRESS 0x68  // Device address when ADO = 0
-#define AK8963_ADDRESS 0x0C   //  Address of magnetometer
-//#define MS5637_ADDRESS 0x76   // Address of altimeter
+#define IMU_WIRE Wire
 #endif
 
-
-#define ADC_256  0x00 // define pressure and temperature conversion rates
-#define ADC_512  0x02
-#define ADC_1024 0x04
-#define ADC_2048 0x06
-#define ADC_4096 0x08
-#define ADC_8192 0x0A
-#define ADC_D1   0x40
-#define ADC_D2   0x50
-
+#define PIN_MPU_INT 27
+#define LoggerDebug false  // set to true to get Serial output for debugging
 
 
 namespace imu {
   
-  Logger& logger = logging::get("imu");
-  
-
-  enum EAscale {
-    AFS_2G = 0,
-    AFS_4G,
-    AFS_8G,
-    AFS_16G
-  };
-  
-  enum EGscale {
-    GFS_250DPS = 0,
-    GFS_500DPS,
-    GFS_1000DPS,
-    GFS_2000DPS
-  };
+  Logger& logger = logging::get(logging::IMU);
   
-  enum EMscale {
-    MFS_14BITS = 0, // 0.6 mG per LSB
-    MFS_16BITS      // 0.15 mG per LSB
-  };
 
- 
-  float getMres(EMscale m_scale) {
-    switch (m_scale)
-    {
-      // Possible magnetometer scales (and their register bit settings) are:
-      // 14 bit resolution (0) and 16 bit resolution (1)
-      case MFS_14BITS: return 10.*4912. / 8190.; // Proper scale to return milliGauss
-      case MFS_16BITS: return 10.*4912. / 32760.0; // Proper scale to return milliGauss
-    }
-  }
-  
-  float getGres(EGscale g_scale) {
-    switch (g_scale)
-    {
-      // Possible gyro scales (and their register bit settings) are:
-      // 250 DPS (00), 500 DPS (01), 1000 DPS (10), and 2000 DPS  (11).
-      // Here's a bit of an algorith to calculate DPS/(ADC tick) based on that 2-bit value:
-      case GFS_250DPS: return 250.0 / 32768.0;
-      case GFS_500DPS: return 500.0 / 32768.0;
-      case GFS_1000DPS: return 1000.0 / 32768.0;
-      case GFS_2000DPS: return 2000.0 / 32768.0;
-    }
-  }
-  
-  float getAres(EAscale a_scale) {
-    switch (a_scale)
-    {
-      // Possible accelerometer scales (and their register bit settings) are:
-      // 2 Gs (00), 4 Gs (01), 8 Gs (10), and 16 Gs  (11).
-      // Here's a bit of an algorith to calculate DPS/(ADC tick) based on that 2-bit value:
-      case AFS_2G: return  2.0 / 32768.0;
-      case AFS_4G: return 4.0 / 32768.0;
-      case AFS_8G: return 8.0 / 32768.0;
-      case AFS_16G: return 16.0 / 32768.0;
-    }
-  }
-   
-  // Specify sensor full scale
-  const EGscale Gscale = GFS_250DPS;
-  const EAscale Ascale = AFS_2G;
-  const EMscale Mscale = MFS_16BITS; // Choose either 14-bit or 16-bit magnetometer resolution
   const uint8_t Mmode = 0x06;        // 2 for 8 Hz, 6 for 100 Hz continuous magnetometer data read
-  
-  const float   aRes = getAres(Ascale); // scale resolutions per LSB for the sensors
-  const float   gRes = getGres(Gscale);
-  const float   mRes = getMres(Mscale); 
 
-  float magCalibration[3] = {0, 0, 0};  // Factory mag calibration and mag bias
+  uint16_t magAdjust[3] = {256, 256, 256};  // Factory mag sensitivity adjustment, Q8 (256 = 1.0)
 
   
   Data data;
   const Data& get() { return data; }
 
   void initMPU9250();
-  void initAK8963(float * destination);
+  void initAK8963(uint16_t * destination);
+  bool verifyConfig();
+  void initI2CMaster();
+  void benchmarkDecode();
+  void startAcquisition();
+  void fuse();
   
-  void readAccelGyroData(int16_t * destination);
-  void readMagData(int16_t * destination);
   int16_t readTempData();
-  bool newMagData();
 
   void readBytes(uint8_t address, uint8_t subAddress, uint8_t count, uint8_t * dest);
+  bool readBytesAsync(uint8_t address, uint8_t subAddress, uint8_t count, uint8_t * dest, i2c::done_fn_t done);
   uint8_t readByte(uint8_t address, uint8_t subAddress);
   void writeByte(uint8_t address, uint8_t subAddress, uint8_t data);
   
     
-  bool begin()
+  const uint16_t* magAdjustment()
+  {
+    return magAdjust;
+  }
+
+  // After a warm restart the MPU9250 has kept running with everything initMPU9250 and
+  // initI2CMaster set up; check that instead of spending 300+ ms redoing it.
+  bool verifyConfig()
   {
-    // Set up the interrupt pin, its set as active high, push-pull
+    struct { uint8_t reg, mask, value; } const expected[] = {
+      { WHO_AM_I_MPU9250, 0xff, 0x71 },
+      { PWR_MGMT_1,       0xff, 0x01 },
+      { CONFIG,           0xff, 0x03 },
+      { SMPLRT_DIV,       0xff, 0x04 },
+      { GYRO_CONFIG,      0x1b, Gscale << 3 },
+      { ACCEL_CONFIG,     0x18, Ascale << 3 },
+      { ACCEL_CONFIG2,    0x0f, 0x03 },
+      { INT_PIN_CFG,      0xff, 0x10 },
+      { INT_ENABLE,       0xff, 0x01 },
+      { I2C_SLV0_ADDR,    0xff, 0x80 | AK8963_ADDRESS },
+      { I2C_SLV0_REG,     0xff, AK8963_XOUT_L },
+      { I2C_SLV0_CTRL,    0xff, 0x80 | 7 },
+      { USER_CTRL,        0x20, 0x20 },
+    };
+    for (const auto& e : expected) {
+      uint8_t v = readByte(MPU9250_ADDRESS, e.reg);
+      if ((v & e.mask) != e.value) {
+        LOG_INFO(logger, "Register 0x%02x is 0x%02x, expected 0x%02x", e.reg, v, e.value);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool begin(const uint16_t* warm_mag_adjust)
+  {
+    // Set up the interrupt pin, its set as active high, push-pull; each data ready pulse is
+    // captured by the timebase so samples carry the time they were taken, not when we read them
     pinMode(PIN_MPU_INT, INPUT);
+    timebase::begin(PIN_MPU_INT);
+
+#ifdef IMU_SIM
+    imusim::begin();
+#endif
+
+    if (warm_mag_adjust && warm_mag_adjust[0] && verifyConfig()) {
+      for (int i=0; i<3; i++) magAdjust[i] = warm_mag_adjust[i];
+      logger.println("MPU9250 and AK8963 still configured, resuming");
+      startAcquisition();
+      return true;
+    }
   
     // Read the WHO_AM_I register, this is a good test of communication
     logger.println("MPU9250 9-axis motion sensor...");
@@ -290,93 +113,224 @@ namespace imu {
     if (d!=0x48) return false;
 
     // Get magnetometer calibration from AK8963 ROM
-    initAK8963(magCalibration); logger.println("AK8963 initialized for active data mode...."); // Initialize device for active mode read of magnetometer
+    initAK8963(magAdjust); logger.println("AK8963 initialized for active data mode...."); // Initialize device for active mode read of magnetometer
+
+    // From here on the AK8963 is only reachable through the MPU9250's I2C master
+    initI2CMaster(); logger.println("MPU9250 I2C master slaved to AK8963....");
 
     if (LoggerDebug) {
       //  logger.println("Calibration values: ");
-      logger.print("X-Axis sensitivity adjustment value "); logger.println(magCalibration[0], 2);
-      logger.print("Y-Axis sensitivity adjustment value "); logger.println(magCalibration[1], 2);
-      logger.print("Z-Axis sensitivity adjustment value "); logger.println(magCalibration[2], 2);
+      logger.print("X-Axis sensitivity adjustment value "); logger.println(magAdjust[0] / 256.f, 2);
+      logger.print("Y-Axis sensitivity adjustment value "); logger.println(magAdjust[1] / 256.f, 2);
+      logger.print("Z-Axis sensitivity adjustment value "); logger.println(magAdjust[2] / 256.f, 2);
+      benchmarkDecode();
+      logger.print("AHRS "); logger.print(ahrs::benchmark()); logger.println(" updates/s");
     }
-    
-//    attachInterrupt(PIN_MPU_INT, myinthandler, RISING);  // define interrupt for INT pin output of MPU9250
 
+    startAcquisition();
     return true;
   }
   
   
-  void update()
+  // One burst from INT_STATUS to EXT_SENS_DATA_06 returns the data ready flag, accel, temp, gyro,
+  // and the AK8963 HXL..ST2 block that the I2C master copied in at the last sample
+  const uint8_t burst_len = EXT_SENS_DATA_06 - INT_STATUS + 1; // 22 bytes
+  const uint32_t sample_period_us = 5000; // SMPLRT_DIV 4
+  const uint32_t late_us = sample_period_us / 2; // reading later than this risks getting the next sample
+
+  // Acquisition runs entirely in interrupts: the data ready edge starts the burst read, the DMA
+  // completion decodes it into the queue, and the main loop only takes samples out. A stall in
+  // the loop of up to queue_size samples (640 ms) costs nothing.
+  struct Sample
   {
-    // If PIN_MPU_INT goes high, all data registers have new data
-//    if (newData == true) { // On interrupt, read data
-//      newData = false;  // reset newData flag
-
-    if (readByte(MPU9250_ADDRESS, INT_STATUS) & 0x01) {
-      int16_t accel_gyro_data[7];
-      readAccelGyroData(accel_gyro_data); // INT cleared on any read
-  
-      // Now we'll calculate the accleration value into actual g's
-      data.ax = (float)accel_gyro_data[0] * aRes; // get actual g value, this depends on scale being set
-      data.ay = (float)accel_gyro_data[1] * aRes;
-      data.az = (float)accel_gyro_data[2] * aRes;
-  
-      // Calculate the gyro value into actual degrees per second
-      data.gx = (float)accel_gyro_data[4] * gRes; // get actual gyro value, this depends on scale being set
-      data.gy = (float)accel_gyro_data[5] * gRes;
-      data.gz = (float)accel_gyro_data[6] * gRes;
-    
-      if (newMagData()) {
-        // Calculate the magnetometer values in milliGauss
-        // Include factory calibration per data sheet 
-        int16_t magCount[3];    // Stores the 16-bit signed magnetometer sensor output
-        readMagData(magCount);
-        data.mx = (float)magCount[0] * mRes * magCalibration[0];
-        data.my = (float)magCount[1] * mRes * magCalibration[1];
-        data.mz = (float)magCount[2] * mRes * magCalibration[2];
-      }
+    uint32_t us;
+    Data data;
+  };
+  const uint32_t queue_size = 128;
+  SpscQueue<Sample, queue_size> samples;
+
+  uint8_t burst[burst_len];
+  volatile bool burst_pending = false; // read submitted, DMA not yet done
+  uint32_t burst_us = 0;  // edge of the sample the burst is reading
+  uint32_t last_edge_us = 0;
+  Data isr_data;          // decode target, keeps the last magnetometer values across overflows
+  uint32_t sample_us = 0; // edge of the sample in data
+  Stats stats_;
+
+  bool decode(const uint8_t* rawData, Data& data);
+
+  // The data-ready interrupt can preempt this, so burst stays ours until burst_pending is cleared
+  void burstDone(bool ok)
+  {
+    if (ok && decode(burst, isr_data)) { // failures are counted by i2c
+      Sample sample = { burst_us, isr_data };
+      if (samples.push(sample)) stats_.samples++;
+      else stats_.overflows++;
     }
+    burst_pending = false;
   }
-  
-  //===================================================================================================================
-  //====== Set of useful function to access acceleration. gyroscope, magnetometer, and temperature data
-  //===================================================================================================================
-  /*
-  void myinthandler()
+
+  void dataReady()
   {
-    newData = true;
+    uint32_t edge_us;
+    timebase::lastEdge(edge_us);
+    if (burst_pending) return; // shows up as a gap at the next edge
+    if (last_edge_us && edge_us - last_edge_us > sample_period_us * 3 / 2) {
+      stats_.missed += (edge_us - last_edge_us + sample_period_us / 2) / sample_period_us - 1;
+    }
+    last_edge_us = edge_us;
+    if (timebase::now_us() - edge_us > late_us) stats_.late++;
+
+    burst_us = edge_us;
+    burst_pending = true;
+    if (!readBytesAsync(MPU9250_ADDRESS, INT_STATUS, burst_len, burst, burstDone)) burst_pending = false; // INT cleared on any read
   }
-  */
-  
-  void readAccelGyroData(int16_t * destination)
+
+  void startAcquisition()
   {
-    uint8_t rawData[14];  // x/y/z accel register data stored here
-    readBytes(MPU9250_ADDRESS, ACCEL_XOUT_H, 14, &rawData[0]);  // Read the 14 raw data registers into data array
-    destination[0] = ((int16_t)rawData[0] << 8) | rawData[1] ;  // Turn the MSB and LSB into a signed 16-bit value
-    destination[1] = ((int16_t)rawData[2] << 8) | rawData[3] ;
-    destination[2] = ((int16_t)rawData[4] << 8) | rawData[5] ;
-    destination[3] = ((int16_t)rawData[6] << 8) | rawData[7] ;
-    destination[4] = ((int16_t)rawData[8] << 8) | rawData[9] ;
-    destination[5] = ((int16_t)rawData[10] << 8) | rawData[11] ;
-    destination[6] = ((int16_t)rawData[12] << 8) | rawData[13] ;
+#ifdef IMU_SIM
+    timebase::setTick(sample_period_us, dataReady); // the model has no INT line, pace it off the timer instead
+#else
+    attachInterrupt(PIN_MPU_INT, dataReady, RISING);
+#endif
   }
 
-  bool newMagData()
+  int16_t saturate(int32_t v)
   {
-    return (readByte(AK8963_ADDRESS, AK8963_ST1) & 0x01);
+    return v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
   }
-  
-  void readMagData(int16_t * destination)
+
+  bool decode(const uint8_t* rawData, Data& data)
   {
-    uint8_t rawData[7];  // x/y/z gyro register data, ST2 register stored here, must read ST2 at end of data acquisition
-    readBytes(AK8963_ADDRESS, AK8963_XOUT_L, 7, &rawData[0]);  // Read the six raw data and ST2 registers sequentially into data array
-    uint8_t c = rawData[6]; // End data read by reading ST2 register
-    if (!(c & 0x08)) { // Check if magnetic sensor overflow set, if not then report data
-      destination[0] = ((int16_t)rawData[1] << 8) | rawData[0] ;  // Turn the MSB and LSB into a signed 16-bit value
-      destination[1] = ((int16_t)rawData[3] << 8) | rawData[2] ;  // Data stored as little Endian
-      destination[2] = ((int16_t)rawData[5] << 8) | rawData[4] ;
+    if (!(rawData[0] & 0x01)) return false;
+
+    // Accel and gyro counts stay raw; aRes and gRes in imu.hpp turn them into g and degrees per second
+    const uint8_t* ag = &rawData[ACCEL_XOUT_H - INT_STATUS];
+    data.ax = ((int16_t)ag[0] << 8) | ag[1]; // Turn the MSB and LSB into a signed 16-bit value
+    data.ay = ((int16_t)ag[2] << 8) | ag[3];
+    data.az = ((int16_t)ag[4] << 8) | ag[5];
+    data.gx = ((int16_t)ag[8] << 8) | ag[9]; // skip temperature
+    data.gy = ((int16_t)ag[10] << 8) | ag[11];
+    data.gz = ((int16_t)ag[12] << 8) | ag[13];
+
+    const uint8_t* mag = &rawData[EXT_SENS_DATA_00 - INT_STATUS];
+    if (!(mag[6] & 0x08)) { // Check if magnetic sensor overflow set in ST2, if not then report data
+      // Include factory calibration per data sheet; mRes turns the result into milliGauss
+      data.mx = saturate(((int32_t)(int16_t)((mag[1] << 8) | mag[0]) * magAdjust[0]) >> 8); // Data stored as little Endian
+      data.my = saturate(((int32_t)(int16_t)((mag[3] << 8) | mag[2]) * magAdjust[1]) >> 8);
+      data.mz = saturate(((int32_t)(int16_t)((mag[5] << 8) | mag[4]) * magAdjust[2]) >> 8);
     }
+    return true;
+  }
+
+  // Feed every sample to the attitude filter. Accelerometer correction is skipped unless the
+  // measured specific force is close to 1 g, since under thrust or in free fall it is not gravity.
+  const float gyro_rad_per_lsb = gRes * (PI / 180.f);
+  const int32_t one_g = (int32_t)(1.f / aRes);
+  const uint32_t accel_trust_lo = (one_g * 8 / 10) * (one_g * 8 / 10);
+  const uint32_t accel_trust_hi = (one_g * 12 / 10) * (one_g * 12 / 10);
+  uint32_t last_fuse_us = 0;
+
+  void fuse()
+  {
+    float dt = last_fuse_us ? (sample_us - last_fuse_us) * 1e-6f : 0.005f;
+    if (dt > 0.05f) dt = 0.05f;
+    last_fuse_us = sample_us;
+
+    uint32_t a2 = accelSquared(data);
+    bool trust_accel = a2 > accel_trust_lo && a2 < accel_trust_hi;
+    float ax = trust_accel ? -data.ax : 0.f;
+    float ay = trust_accel ? data.ay : 0.f;
+    float az = trust_accel ? data.az : 0.f;
+
+    // The AK8963 axes are swapped relative to the MPU9250's: mag x is accel y, mag y is accel x, mag z is -accel z
+    ahrs::update(data.gx * gyro_rad_per_lsb, -data.gy * gyro_rad_per_lsb, -data.gz * gyro_rad_per_lsb, ax, ay, az, data.my, -data.mx, data.mz, dt);
+  }
+
+  Attitude get_attitude()
+  {
+    const ahrs::Quaternion& q = ahrs::get();
+    Attitude att;
+    att.q0 = q.q0;
+    att.q1 = q.q1;
+    att.q2 = q.q2;
+    att.q3 = q.q3;
+    att.yaw   = atan2f(2.f * (q.q1 * q.q2 + q.q0 * q.q3), q.q0 * q.q0 + q.q1 * q.q1 - q.q2 * q.q2 - q.q3 * q.q3) * (180.f / PI);
+    att.pitch = -asinf(2.f * (q.q1 * q.q3 - q.q0 * q.q2)) * (180.f / PI);
+    att.roll  = atan2f(2.f * (q.q0 * q.q1 + q.q2 * q.q3), q.q0 * q.q0 - q.q1 * q.q1 - q.q2 * q.q2 + q.q3 * q.q3) * (180.f / PI);
+    return att;
+  }
+
+  // Reference for benchmarkDecode: the float scaling update() used to do for every sample
+  void decodeFloat(const uint8_t* rawData, float* dest)
+  {
+    const uint8_t* ag = &rawData[ACCEL_XOUT_H - INT_STATUS];
+    for (int i=0; i<3; i++) dest[i] = (float)(int16_t)((ag[2*i] << 8) | ag[2*i+1]) * aRes;
+    for (int i=0; i<3; i++) dest[3+i] = (float)(int16_t)((ag[8+2*i] << 8) | ag[9+2*i]) * gRes;
+    const uint8_t* mag = &rawData[EXT_SENS_DATA_00 - INT_STATUS];
+    for (int i=0; i<3; i++) dest[6+i] = (float)(int16_t)((mag[2*i+1] << 8) | mag[2*i]) * mRes * (magAdjust[i] / 256.f);
+  }
+
+  // Cycles per sample of the integer decode versus the old float path, including the CSV formatting
+  // each of them implies. Runs on the board; the Cortex-M0+ has no cycle counter, so time 1000 rounds.
+  void benchmarkDecode()
+  {
+    const int rounds = 1000;
+    uint8_t raw[burst_len];
+    for (int i=0; i<burst_len; i++) raw[i] = i * 37 + 1;
+    raw[0] = 0x01;
+    raw[burst_len-1] = 0;
+    const float cycles_per_us = SystemCoreClock / 1000000.f;
+
+    unsigned long t0 = micros();
+    Data decoded = {};
+    for (int n=0; n<rounds; n++) decode(raw, decoded);
+    unsigned long t1 = micros();
+    for (int n=0; n<rounds; n++) String(decoded.ax) + "," + String(decoded.gx) + "," + String(decoded.mx);
+    unsigned long t2 = micros();
+
+    float f[9];
+    for (int n=0; n<rounds; n++) decodeFloat(raw, f);
+    unsigned long t3 = micros();
+    for (int n=0; n<rounds; n++) String(f[0]) + "," + String(f[3]) + "," + String(f[6]);
+    unsigned long t4 = micros();
+
+    logger.println(String("decode int ") + String((t1-t0) * cycles_per_us / rounds, 0) + " cycles/sample, float " + String((t3-t2) * cycles_per_us / rounds, 0));
+    logger.println(String("format int ") + String((t2-t1) * cycles_per_us / rounds, 0) + " cycles/3 values, float " + String((t4-t3) * cycles_per_us / rounds, 0));
+  }
+
+  // Take the oldest queued sample and run it through the attitude filter
+  bool update()
+  {
+    uint32_t depth = samples.size();
+    if (depth > stats_.max_queue) stats_.max_queue = depth;
+    Sample sample;
+    if (!samples.pop(sample)) return false;
+    data = sample.data;
+    sample_us = sample.us;
+    fuse();
+    return true;
   }
   
+  uint32_t sampleTime()
+  {
+    return sample_us;
+  }
+
+  const Stats& stats()
+  {
+    return stats_;
+  }
+
+  void report()
+  {
+    LOG_INFO(logger, "%lu samples, %lu late, %lu missed, %lu lost to a full queue, queue peaked at %lu", stats_.samples, stats_.late, stats_.missed, stats_.overflows, stats_.max_queue);
+  }
+
+  //===================================================================================================================
+  //====== Set of useful function to access acceleration. gyroscope, magnetometer, and temperature data
+  //===================================================================================================================
+  
   int16_t readTempData()
   {
     uint8_t rawData[2];  // x/y/z gyro register data stored here
@@ -384,7 +338,7 @@ namespace imu {
     return ((int16_t)rawData[0] << 8) | rawData[1] ;  // Turn the MSB and LSB into a 16-bit value
   }
   
-  void initAK8963(float * destination)
+  void initAK8963(uint16_t * destination)
   {
     // First extract the factory calibration for each magnetometer axis
     uint8_t rawData[3];  // x/y/z gyro calibration data stored here
@@ -393,9 +347,9 @@ namespace imu {
     writeByte(AK8963_ADDRESS, AK8963_CNTL, 0x0F); // Enter Fuse ROM access mode
     delay(10);
     readBytes(AK8963_ADDRESS, AK8963_ASAX, 3, &rawData[0]);  // Read the x-, y-, and z-axis calibration values
-    destination[0] =  (float)(rawData[0] - 128) / 256. + 1.; // Return x-axis sensitivity adjustment values, etc.
-    destination[1] =  (float)(rawData[1] - 128) / 256. + 1.;
-    destination[2] =  (float)(rawData[2] - 128) / 256. + 1.;
+    destination[0] = rawData[0] + 128; // Return x-axis sensitivity adjustment values in Q8, (ASA - 128) / 256 + 1
+    destination[1] = rawData[1] + 128;
+    destination[2] = rawData[2] + 128;
     writeByte(AK8963_ADDRESS, AK8963_CNTL, 0x00); // Power down magnetometer
     delay(10);
     // Configure the magnetometer for continuous read and highest resolution
@@ -466,6 +420,20 @@ namespace imu {
     delay(100);
   }
 
+
+  void initI2CMaster()
+  {
+    // Have the MPU9250 read the 6 AK8963 data bytes and ST2 into EXT_SENS_DATA_00..06 at every sample.
+    // Reading ST2 releases the AK8963 data lock, so the continuous mode set in initAK8963 keeps running.
+    writeByte(MPU9250_ADDRESS, I2C_MST_CTRL, 0x0D);                   // I2C master clock 400 kHz
+    writeByte(MPU9250_ADDRESS, I2C_SLV0_ADDR, 0x80 | AK8963_ADDRESS); // Read transfer from the AK8963
+    writeByte(MPU9250_ADDRESS, I2C_SLV0_REG, AK8963_XOUT_L);          // Starting at HXL
+    writeByte(MPU9250_ADDRESS, I2C_SLV0_CTRL, 0x80 | 7);              // Enable, 7 bytes (HXL..HZH, ST2)
+    writeByte(MPU9250_ADDRESS, INT_PIN_CFG, 0x10);                    // Bypass off, INT is 50 microsecond pulse and any read to clear
+    writeByte(MPU9250_ADDRESS, USER_CTRL, 0x20);                      // I2C_MST_EN
+    delay(20); // Let the master complete a couple of reads before the first burst
+  }
+
   
   /*
   // Function which accumulates gyro and accelerometer data after device initialization. It calculates the average
@@ -779,32 +747,43 @@ namespace imu {
   // I2C read/write functions for the MPU9250 and AK8963 sensors
   void writeByte(uint8_t address, uint8_t subAddress, uint8_t data)
   {
-    Wire.beginTransmission(address);  // Initialize the Tx buffer
-    Wire.write(subAddress);           // Put slave register address in Tx buffer
-    Wire.write(data);                 // Put data in Tx buffer
-    Wire.endTransmission();           // Send the Tx buffer
+    IMU_WIRE.beginTransmission(address);  // Initialize the Tx buffer
+    IMU_WIRE.write(subAddress);           // Put slave register address in Tx buffer
+    IMU_WIRE.write(data);                 // Put data in Tx buffer
+    IMU_WIRE.endTransmission();           // Send the Tx buffer
   }
   
   uint8_t readByte(uint8_t address, uint8_t subAddress)
   {
     uint8_t data; // `data` will store the register data
-    Wire.beginTransmission(address);         // Initialize the Tx buffer
-    Wire.write(subAddress);                  // Put slave register address in Tx buffer
-    Wire.endTransmission(false);             // Send the Tx buffer, but send a restart to keep connection alive
-    Wire.requestFrom(address, (size_t) 1);   // Read one byte from slave register address
-    data = Wire.read();                      // Fill Rx buffer with result
+    IMU_WIRE.beginTransmission(address);         // Initialize the Tx buffer
+    IMU_WIRE.write(subAddress);                  // Put slave register address in Tx buffer
+    IMU_WIRE.endTransmission(false);             // Send the Tx buffer, but send a restart to keep connection alive
+    IMU_WIRE.requestFrom(address, (size_t) 1);   // Read one byte from slave register address
+    data = IMU_WIRE.read();                      // Fill Rx buffer with result
     return data;                             // Return data read from slave register
   }
   
+  bool readBytesAsync(uint8_t address, uint8_t subAddress, uint8_t count, uint8_t * dest, i2c::done_fn_t done)
+  {
+#ifdef IMU_SIM
+    readBytes(address, subAddress, count, dest);
+    done(true);
+    return true;
+#else
+    return i2c::readAsync(address, subAddress, count, dest, done);
+#endif
+  }
+
   void readBytes(uint8_t address, uint8_t subAddress, uint8_t count, uint8_t * dest)
   {
-    Wire.beginTransmission(address);   // Initialize the Tx buffer
-    Wire.write(subAddress);            // Put slave register address in Tx buffer
-    Wire.endTransmission(false);       // Send the Tx buffer, but send a restart to keep connection alive
+    IMU_WIRE.beginTransmission(address);   // Initialize the Tx buffer
+    IMU_WIRE.write(subAddress);            // Put slave register address in Tx buffer
+    IMU_WIRE.endTransmission(false);       // Send the Tx buffer, but send a restart to keep connection alive
     uint8_t i = 0;
-    Wire.requestFrom(address, (size_t) count);  // Read bytes from slave register address
-    while (Wire.available()) {         // Put read results in the Rx buffer
-      dest[i++] = Wire.read();
+    IMU_WIRE.requestFrom(address, (size_t) count);  // Read bytes from slave register address
+    while (IMU_WIRE.available()) {         // Put read results in the Rx buffer
+      dest[i++] = IMU_WIRE.read();
     }
   }
   
@@ -1,16 +1,84 @@
+#pragma once
 #include "common.hpp"
 
 namespace imu
 {
+  enum EAscale {
+    AFS_2G = 0,
+    AFS_4G,
+    AFS_8G,
+    AFS_16G
+  };
+
+  enum EGscale {
+    GFS_250DPS = 0,
+    GFS_500DPS,
+    GFS_1000DPS,
+    GFS_2000DPS
+  };
+
+  enum EMscale {
+    MFS_14BITS = 0, // 0.6 mG per LSB
+    MFS_16BITS      // 0.15 mG per LSB
+  };
+
+  // Possible accelerometer scales (and their register bit settings) are:
+  // 2 Gs (00), 4 Gs (01), 8 Gs (10), and 16 Gs  (11).
+  constexpr float getAres(EAscale a_scale) { return (2 << a_scale) / 32768.0f; }
+
+  // Possible gyro scales (and their register bit settings) are:
+  // 250 DPS (00), 500 DPS (01), 1000 DPS (10), and 2000 DPS  (11).
+  constexpr float getGres(EGscale g_scale) { return (250 << g_scale) / 32768.0f; }
+
+  // Possible magnetometer scales (and their register bit settings) are:
+  // 14 bit resolution (0) and 16 bit resolution (1). Proper scale to return milliGauss
+  constexpr float getMres(EMscale m_scale) { return m_scale==MFS_14BITS ? 10.f*4912.f / 8190.f : 10.f*4912.f / 32760.f; }
+
+  // Specify sensor full scale
+  const EGscale Gscale = GFS_250DPS;
+  const EAscale Ascale = AFS_16G; // boost is well past 2 g
+  const EMscale Mscale = MFS_16BITS; // Choose either 14-bit or 16-bit magnetometer resolution
+
+  // Data holds raw counts; multiply by these to get g, degrees per second and milliGauss.
+  // Conversion is left to whoever needs physical units (output or the ground).
+  constexpr float aRes = getAres(Ascale);
+  constexpr float gRes = getGres(Gscale);
+  constexpr float mRes = getMres(Mscale); // after factory sensitivity adjustment
+
   struct Data {
-    float ax, ay, az;
-    float gx, gy, gz;
-    float mx, my, mz;
+    int16_t ax, ay, az;
+    int16_t gx, gy, gz;
+    int16_t mx, my, mz;
+  };
+
+  // Squared length of the acceleration in counts. Each square is at most 2^30, but three of them
+  // overflow int32, so they are summed unsigned.
+  inline uint32_t accelSquared(const Data& data)
+  {
+    return (uint32_t)((int32_t)data.ax * data.ax) + (uint32_t)((int32_t)data.ay * data.ay) + (uint32_t)((int32_t)data.az * data.az);
+  }
+
+  struct Stats {
+    unsigned long samples = 0;   // queued for the main loop
+    unsigned long late = 0;      // read started more than half a sample period after data ready
+    unsigned long missed = 0;    // data ready edges never read, counted from gaps between edges
+    unsigned long overflows = 0; // read, but the main loop was too far behind to take them
+    unsigned long max_queue = 0;
+  };
+
+  struct Attitude {
+    float q0, q1, q2, q3;    // orientation quaternion
+    float roll, pitch, yaw;  // degrees
   };
 
   const Data& get();
+  Attitude get_attitude();
 
-  bool begin();
-  void update();
+  bool begin(const uint16_t* warm_mag_adjust = nullptr); // given the previous session's, try to resume without reinit
+  const uint16_t* magAdjustment(); // Q8 factory sensitivity adjustment, for keeping across a warm restart
+  bool update(); // next sample from the interrupt-driven queue; call until it returns false
+  uint32_t sampleTime(); // timebase::now_us() clock at the data ready edge of the current sample
+  const Stats& stats();
+  void report();
 }
-
+
@@ -0,0 +1,465 @@
+#include "imusim.hpp"
+#include "logging.hpp"
+#include "mpu9250.hpp"
+
+namespace imusim
+{
+  Logger& logger = logging::get(logging::IMUSIM);
+
+  // Pad, boost, coast, descent under chute, landed. A zero duration holds the segment forever.
+  const Segment default_profile[] = {
+    { 20000,  1.0f,   0.f, 0.01f },
+    {  3000,  7.0f, 180.f, 0.50f },
+    {  8000, -0.2f,  90.f, 0.05f },
+    { 60000,  1.0f,  20.f, 0.20f },
+    {     0,  1.0f,   0.f, 0.01f }
+  };
+
+  const Segment* profile = default_profile;
+  size_t profile_len = sizeof(default_profile) / sizeof(*default_profile);
+
+  // earth field in uT, body frame while standing on the pad (z up)
+  const float field_h = 14.f;
+  const float field_v = -50.f;
+
+  unsigned long scl_hz = 400000;
+  unsigned long start_us = 0;
+  unsigned long next_sample_us = 0;
+  unsigned long next_mag_us = 0;
+  bool mag_single_pending = false;
+  float roll_deg = 0.f;
+  uint32_t noise_state = 12345;
+
+  Stats stats_;
+
+  uint8_t mpu_regs[128];
+  uint8_t ak_regs[0x13];
+
+  uint8_t fifo[512];
+  int fifo_head = 0;
+  int fifo_len = 0;
+
+  bool sample_pending = false; // latest sample neither read from the data registers nor pushed to the FIFO
+
+  // transaction state
+  uint8_t tx_address = 0;
+  int tx_len = 0;
+  uint8_t tx_buff[32];
+  uint8_t reg_ptr[2] = {0, 0}; // register pointer of the MPU9250 and AK8963
+  uint8_t rx_buff[64];
+  int rx_len = 0;
+  int rx_idx = 0;
+
+  SimWire wire;
+
+
+  float noise()
+  {
+    noise_state = noise_state * 1664525ul + 1013904223ul;
+    return (float)(int32_t)noise_state / 2147483648.f;
+  }
+
+  void put16be(uint8_t* dst, int16_t v)
+  {
+    dst[0] = (uint16_t)v >> 8;
+    dst[1] = (uint16_t)v & 0xFF;
+  }
+
+  void put16le(uint8_t* dst, int16_t v)
+  {
+    dst[0] = (uint16_t)v & 0xFF;
+    dst[1] = (uint16_t)v >> 8;
+  }
+
+  int16_t saturate(float v)
+  {
+    if (v > 32767.f) return 32767;
+    if (v < -32768.f) return -32768;
+    return (int16_t)v;
+  }
+
+  const Segment& segmentAt(unsigned long t_ms)
+  {
+    for (size_t i=0; i<profile_len; i++) {
+      const Segment& seg = profile[i];
+      if (seg.duration_ms==0 || t_ms < seg.duration_ms) return seg;
+      t_ms -= seg.duration_ms;
+    }
+    return profile[profile_len-1];
+  }
+
+  void resetMpu()
+  {
+    memset(mpu_regs, 0, sizeof(mpu_regs));
+    mpu_regs[PWR_MGMT_1] = 0x01;
+    mpu_regs[WHO_AM_I_MPU9250] = 0x71;
+    fifo_head = 0;
+    fifo_len = 0;
+    sample_pending = false;
+  }
+
+  void resetAk()
+  {
+    memset(ak_regs, 0, sizeof(ak_regs));
+    ak_regs[WHO_AM_I_AK8963] = 0x48;
+    ak_regs[INFO] = 0x9A;
+    mag_single_pending = false;
+  }
+
+  unsigned long samplePeriodUs()
+  {
+    uint8_t dlpf = mpu_regs[CONFIG] & 0x07;
+    bool fchoice_b = mpu_regs[GYRO_CONFIG] & 0x03;
+    unsigned long internal_hz = (!fchoice_b && dlpf>=1 && dlpf<=6) ? 1000 : 8000;
+    return 1000000ul * (1 + mpu_regs[SMPLRT_DIV]) / internal_hz;
+  }
+
+  unsigned long magPeriodUs()
+  {
+    switch (ak_regs[AK8963_CNTL] & 0x0F) {
+      case 0x02: return 125000;
+      case 0x06: return 10000;
+      default: return 0;
+    }
+  }
+
+  // returns false if the FIFO was full and data was lost
+  bool fifoPush(uint8_t value)
+  {
+    if (fifo_len==sizeof(fifo)) {
+      if (mpu_regs[CONFIG] & 0x40) return false; // FIFO_MODE: drop new data when full
+      fifo_head = (fifo_head + 1) % sizeof(fifo);
+      fifo_len--;
+      fifo[(fifo_head + fifo_len) % sizeof(fifo)] = value;
+      fifo_len++;
+      return false;
+    }
+    fifo[(fifo_head + fifo_len) % sizeof(fifo)] = value;
+    fifo_len++;
+    return true;
+  }
+
+  uint8_t fifoPop()
+  {
+    if (fifo_len==0) return 0xFF;
+    uint8_t value = fifo[fifo_head];
+    fifo_head = (fifo_head + 1) % sizeof(fifo);
+    fifo_len--;
+    return value;
+  }
+
+  uint8_t readAk(uint8_t reg);
+
+  // the MPU9250's own I2C master fetching from the AK8963 on the auxiliary bus
+  void slaveRead()
+  {
+    if (mpu_regs[I2C_SLV0_ADDR] != (0x80 | AK8963_ADDRESS)) {
+      mpu_regs[I2C_MST_STATUS] |= 0x01; // I2C_SLV0_NACK
+      return;
+    }
+    uint8_t reg = mpu_regs[I2C_SLV0_REG];
+    int len = mpu_regs[I2C_SLV0_CTRL] & 0x0F;
+    for (int i=0; i<len && EXT_SENS_DATA_00 + i <= EXT_SENS_DATA_23; i++) {
+      mpu_regs[EXT_SENS_DATA_00 + i] = readAk(reg + i);
+    }
+  }
+
+  void produceSample(unsigned long t_us, float dt)
+  {
+    const Segment& seg = segmentAt((t_us - start_us) / 1000);
+    roll_deg += seg.spin_dps * dt;
+    if (roll_deg >= 360.f) roll_deg -= 360.f;
+
+    float ax = seg.vibration_g * noise();
+    float ay = seg.vibration_g * noise();
+    float az = seg.accel_g + seg.vibration_g * noise();
+    float gx = 50.f * seg.vibration_g * noise();
+    float gy = 50.f * seg.vibration_g * noise();
+    float gz = seg.spin_dps + 50.f * seg.vibration_g * noise();
+
+    float a_lsb = 16384.f / (1 << ((mpu_regs[ACCEL_CONFIG] >> 3) & 0x03));
+    float g_lsb = 32768.f / (250 << ((mpu_regs[GYRO_CONFIG] >> 3) & 0x03));
+    put16be(&mpu_regs[ACCEL_XOUT_H], saturate(ax * a_lsb));
+    put16be(&mpu_regs[ACCEL_YOUT_H], saturate(ay * a_lsb));
+    put16be(&mpu_regs[ACCEL_ZOUT_H], saturate(az * a_lsb));
+    put16be(&mpu_regs[TEMP_OUT_H], saturate((25.f - 21.f) * 333.87f));
+    put16be(&mpu_regs[GYRO_XOUT_H], saturate(gx * g_lsb));
+    put16be(&mpu_regs[GYRO_YOUT_H], saturate(gy * g_lsb));
+    put16be(&mpu_regs[GYRO_ZOUT_H], saturate(gz * g_lsb));
+    if ((mpu_regs[USER_CTRL] & 0x20) && (mpu_regs[I2C_SLV0_CTRL] & 0x80)) slaveRead();
+
+    stats_.samples++;
+    if (sample_pending) stats_.samples_dropped++;
+    sample_pending = true;
+
+    if (mpu_regs[USER_CTRL] & 0x40) {
+      uint8_t en = mpu_regs[FIFO_EN];
+      bool ok = true;
+      if (en & 0x08) for (int i=0; i<6; i++) ok &= fifoPush(mpu_regs[ACCEL_XOUT_H + i]);
+      if (en & 0x80) for (int i=0; i<2; i++) ok &= fifoPush(mpu_regs[TEMP_OUT_H + i]);
+      if (en & 0x40) for (int i=0; i<2; i++) ok &= fifoPush(mpu_regs[GYRO_XOUT_H + i]);
+      if (en & 0x20) for (int i=0; i<2; i++) ok &= fifoPush(mpu_regs[GYRO_YOUT_H + i]);
+      if (en & 0x10) for (int i=0; i<2; i++) ok &= fifoPush(mpu_regs[GYRO_ZOUT_H + i]);
+      if (en & 0x01) for (int i=0; i<(mpu_regs[I2C_SLV0_CTRL] & 0x0F); i++) ok &= fifoPush(mpu_regs[EXT_SENS_DATA_00 + i]);
+      if (en) sample_pending = false;
+      if (!ok) {
+        stats_.fifo_overflows++;
+        mpu_regs[INT_STATUS] |= 0x10;
+      }
+    }
+
+    mpu_regs[INT_STATUS] |= 0x01;
+  }
+
+  void produceMagSample()
+  {
+    float c = cosf(roll_deg * (PI / 180.f));
+    float s = sinf(roll_deg * (PI / 180.f));
+    float bx = field_h * c;
+    float by = -field_h * s;
+    float bz = field_v;
+
+    // AK8963 axes: x along the accel y axis, y along accel x, z opposite accel z
+    bool bits16 = ak_regs[AK8963_CNTL] & 0x10;
+    float lsb = bits16 ? 1.f / 0.15f : 1.f / 0.6f;
+    put16le(&ak_regs[AK8963_XOUT_L], saturate(by * lsb));
+    put16le(&ak_regs[AK8963_YOUT_L], saturate(bx * lsb));
+    put16le(&ak_regs[AK8963_ZOUT_L], saturate(-bz * lsb));
+
+    bool overflow = fabsf(bx) >= 4912.f || fabsf(by) >= 4912.f || fabsf(bz) >= 4912.f; // HOFL is per axis
+    ak_regs[AK8963_ST2] = (overflow ? 0x08 : 0x00) | (bits16 ? 0x10 : 0x00);
+
+    stats_.mag_samples++;
+    if (ak_regs[AK8963_ST1] & 0x01) {
+      ak_regs[AK8963_ST1] |= 0x02;
+      stats_.mag_overruns++;
+    }
+    ak_regs[AK8963_ST1] |= 0x01;
+  }
+
+  void advance()
+  {
+    unsigned long now = micros();
+
+    if (!(mpu_regs[PWR_MGMT_1] & 0x40)) {
+      unsigned long period = samplePeriodUs();
+      if ((long)(now - next_sample_us) > 1000000l) {
+        // we were not called for a long time; account for the lost samples in bulk
+        unsigned long skipped = (now - next_sample_us) / period;
+        stats_.samples += skipped;
+        stats_.samples_dropped += skipped;
+        next_sample_us += skipped * period;
+      }
+      while ((long)(now - next_sample_us) >= 0) {
+        produceSample(next_sample_us, period * 1e-6f);
+        next_sample_us += period;
+      }
+    } else {
+      next_sample_us = now;
+    }
+
+    unsigned long mag_period = magPeriodUs();
+    if (mag_period) {
+      if ((long)(now - next_mag_us) > 1000000l) next_mag_us = now;
+      while ((long)(now - next_mag_us) >= 0) {
+        produceMagSample();
+        next_mag_us += mag_period;
+      }
+    } else if (mag_single_pending && (long)(now - next_mag_us) >= 0) {
+      produceMagSample();
+      mag_single_pending = false;
+      ak_regs[AK8963_CNTL] &= 0xF0; // back to power-down
+    }
+  }
+
+  bool akReachable()
+  {
+    return (mpu_regs[INT_PIN_CFG] & 0x02) && !(mpu_regs[USER_CTRL] & 0x20); // BYPASS_EN and I2C_MST_EN off
+  }
+
+  uint8_t readMpu(uint8_t reg)
+  {
+    uint8_t value;
+    if (reg==FIFO_R_W) value = fifoPop();
+    else if (reg==FIFO_COUNTH) value = (fifo_len >> 8) & 0x1F;
+    else if (reg==FIFO_COUNTL) value = fifo_len & 0xFF;
+    else value = mpu_regs[reg & 0x7F];
+
+    if (reg==INT_STATUS || (mpu_regs[INT_PIN_CFG] & 0x10)) mpu_regs[INT_STATUS] = 0;
+    if (reg>=ACCEL_XOUT_H && reg<=GYRO_ZOUT_L && sample_pending) {
+      sample_pending = false;
+      stats_.samples_read++;
+    }
+    return value;
+  }
+
+  void writeMpu(uint8_t reg, uint8_t value)
+  {
+    if (reg==WHO_AM_I_MPU9250 || reg==INT_STATUS || (reg>=ACCEL_XOUT_H && reg<=EXT_SENS_DATA_23)) return; // read-only
+    if (reg==PWR_MGMT_1 && (value & 0x80)) {
+      resetMpu();
+      return;
+    }
+    if (reg==USER_CTRL && (value & 0x04)) { // FIFO_RST, self-clearing
+      fifo_head = 0;
+      fifo_len = 0;
+      value &= ~0x04;
+    }
+    if (reg==FIFO_R_W) {
+      fifoPush(value);
+      return;
+    }
+    mpu_regs[reg & 0x7F] = value;
+  }
+
+  uint8_t readAk(uint8_t reg)
+  {
+    if (reg >= sizeof(ak_regs)) return 0;
+    if (reg>=AK8963_ASAX && reg<=AK8963_ASAZ && (ak_regs[AK8963_CNTL] & 0x0F)!=0x0F) return 0;
+    uint8_t value = ak_regs[reg];
+    if (reg==AK8963_ST2) ak_regs[AK8963_ST1] &= ~0x03; // reading ST2 ends the data read
+    return value;
+  }
+
+  void writeAk(uint8_t reg, uint8_t value)
+  {
+    if (reg==AK8963_CNTL) {
+      ak_regs[AK8963_CNTL] = value & 0x1F;
+      uint8_t mode = value & 0x0F;
+      next_mag_us = micros() + magPeriodUs();
+      if (mode==0x01) {
+        mag_single_pending = true;
+        next_mag_us = micros() + 7200;
+      }
+      if (mode==0x0F) { // fuse ROM values of a typical part
+        ak_regs[AK8963_ASAX] = 0xB0;
+        ak_regs[AK8963_ASAY] = 0xB2;
+        ak_regs[AK8963_ASAZ] = 0xA6;
+      }
+    } else if (reg==AK8963_ASTC || reg==AK8963_I2CDIS) {
+      ak_regs[reg] = value;
+    } else if (reg==0x0B && (value & 0x01)) { // CNTL2 soft reset
+      resetAk();
+    }
+  }
+
+  void accountTransaction(int bytes, bool stop)
+  {
+    // start (or repeated start) + address byte + data bytes, 9 clocks per byte incl. ack
+    unsigned long clocks = 1 + 9ul * (1 + bytes) + (stop ? 1 : 0);
+    stats_.transactions++;
+    stats_.bytes += 1 + bytes;
+    stats_.bus_us += clocks * 1000000ul / scl_hz;
+  }
+
+
+  void SimWire::beginTransmission(uint8_t address)
+  {
+    tx_address = address;
+    tx_len = 0;
+  }
+
+  size_t SimWire::write(uint8_t data)
+  {
+    if (tx_len >= (int)sizeof(tx_buff)) return 0;
+    tx_buff[tx_len++] = data;
+    return 1;
+  }
+
+  uint8_t SimWire::endTransmission(bool stop)
+  {
+    advance();
+    accountTransaction(tx_len, stop);
+    bool mpu = tx_address==MPU9250_ADDRESS;
+    if (!mpu && !(tx_address==AK8963_ADDRESS && akReachable())) return 2; // address NACK
+    if (tx_len==0) return 0;
+
+    uint8_t& ptr = reg_ptr[mpu ? 0 : 1];
+    ptr = tx_buff[0];
+    for (int i=1; i<tx_len; i++) {
+      if (mpu) writeMpu(ptr, tx_buff[i]);
+      else writeAk(ptr, tx_buff[i]);
+      if (!(mpu && ptr==FIFO_R_W)) ptr++;
+    }
+    return 0;
+  }
+
+  uint8_t SimWire::requestFrom(uint8_t address, size_t count, bool stop)
+  {
+    advance();
+    rx_len = 0;
+    rx_idx = 0;
+    bool mpu = address==MPU9250_ADDRESS;
+    if (!mpu && !(address==AK8963_ADDRESS && akReachable())) {
+      accountTransaction(0, true);
+      return 0;
+    }
+    if (count > sizeof(rx_buff)) count = sizeof(rx_buff);
+    accountTransaction(count, stop);
+
+    uint8_t& ptr = reg_ptr[mpu ? 0 : 1];
+    for (size_t i=0; i<count; i++) {
+      rx_buff[rx_len++] = mpu ? readMpu(ptr) : readAk(ptr);
+      if (!(mpu && ptr==FIFO_R_W)) ptr++;
+    }
+    return rx_len;
+  }
+
+  int SimWire::available()
+  {
+    return rx_len - rx_idx;
+  }
+
+  int SimWire::read()
+  {
+    if (rx_idx >= rx_len) return -1;
+    return rx_buff[rx_idx++];
+  }
+
+
+  void begin(unsigned long scl_hz)
+  {
+    imusim::scl_hz = scl_hz;
+    resetMpu();
+    resetAk();
+    roll_deg = 0.f;
+    start_us = micros();
+    next_sample_us = start_us;
+    next_mag_us = start_us;
+    resetStats();
+    logger.println("Simulating MPU9250/AK8963");
+  }
+
+  void setProfile(const Segment* segments, size_t count)
+  {
+    assert(segments && count);
+    profile = segments;
+    profile_len = count;
+    start_us = micros();
+  }
+
+  const Stats& stats()
+  {
+    return stats_;
+  }
+
+  void resetStats()
+  {
+    stats_ = Stats();
+  }
+
+  void report()
+  {
+    // the imu drives the model from the timer interrupt, so bring it up to date and copy the stats with it masked
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    advance();
+    Stats stats = stats_;
+    __set_PRIMASK(primask);
+    unsigned long read = stats.samples_read ? stats.samples_read : 1;
+    logger.println(String("samples ") + String(stats.samples) + " read " + String(stats.samples_read) + " dropped " + String(stats.samples_dropped)
+      + " fifo_ovf " + String(stats.fifo_overflows) + " mag " + String(stats.mag_samples) + " mag_dor " + String(stats.mag_overruns));
+    logger.println(String("bus ") + String(stats.bus_us) + "us in " + String(stats.transactions) + " transactions, " + String(stats.bus_us / read) + "us/sample");
+  }
+}
+
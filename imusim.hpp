@@ -0,0 +1,49 @@
+#pragma once
+#include "common.hpp"
+
+// Register-level model of the MPU9250 and AK8963, standing in for Wire when IMU_SIM is defined.
+// Samples are generated from a piecewise motion profile in real time (micros()), so the
+// acquisition code sees the same data-ready timing, FIFO and overflow behaviour as on the board.
+namespace imusim
+{
+  struct Segment
+  {
+    unsigned long duration_ms;
+    float accel_g;    // specific force along the body z axis
+    float spin_dps;   // roll rate about the body z axis
+    float vibration_g; // peak random vibration on all axes
+  };
+
+  struct Stats
+  {
+    unsigned long transactions = 0;
+    unsigned long bytes = 0;
+    unsigned long bus_us = 0;         // estimated time on the wire at the configured SCL rate
+    unsigned long samples = 0;        // samples produced by the accel/gyro
+    unsigned long samples_read = 0;   // samples whose data registers were read at least once
+    unsigned long samples_dropped = 0; // samples overwritten before anyone read them
+    unsigned long fifo_overflows = 0;
+    unsigned long mag_samples = 0;
+    unsigned long mag_overruns = 0;   // AK8963 ST1.DOR events
+  };
+
+  class SimWire
+  {
+  public:
+    void beginTransmission(uint8_t address);
+    size_t write(uint8_t data);
+    uint8_t endTransmission(bool stop = true);
+    uint8_t requestFrom(uint8_t address, size_t count, bool stop = true);
+    int available();
+    int read();
+  };
+
+  extern SimWire wire;
+
+  void begin(unsigned long scl_hz = 400000);
+  void setProfile(const Segment* segments, size_t count); // segments must outlive the simulation
+  const Stats& stats();
+  void resetStats();
+  void report();
+}
+
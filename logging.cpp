@@ -1,24 +1,28 @@
 #include "logging.hpp"
 #include <SD.h>
 #include <algorithm>
-#include <vector>
-#include <memory>
+#include <stdarg.h>
 #include "watchdog.hpp"
+#include "crashlog.hpp"
 
 namespace logging
 {
   File* logfile = nullptr;
+  File* eventfile = nullptr;
   bool serial_open = false;
+  bool has_output = false;
+  const char* const level_prefixes[] = {"", "", "warning: ", "error: "};
 
-  void begin()
+  void begin(bool wait_for_serial)
   {
     // try bring up serial for 4 sec
     Serial.begin(115200);
-    for (int i = 0; i<40 && !Serial; i++) {
+    for (int i = 0; i<40 && !Serial && wait_for_serial; i++) {
       delay(100);
       watchdog::tickle();
     }
     serial_open = Serial;
+    has_output = serial_open || logfile || eventfile;
   }
 
   
@@ -31,47 +35,119 @@ namespace logging
       return idx0>=0 ? idx0 : idx1;
   }
 
+  // Finished lines and event records wait here until update() hands them to Serial and SD, so
+  // whoever logs (including the UART interrupts echoing traffic) never waits on USB or the card.
+  // Entries are u8 sink, u8 length, bytes.
+  enum Sink : uint8_t { SINK_TEXT, SINK_EVENT };
+  const int queue_size = 1024;
+  const int drain_budget = 256; // bytes handed on per update()
+  uint8_t queue[queue_size];
+  int queue_head = 0;
+  int queue_len = 0;
+  DropPolicy drop_policy = DROP_OLDEST;
+  bool synchronous = true; // until setup is done and update() gets called
+  unsigned long dropped_ = 0;
+  unsigned long dropped_reported = 0;
+
+  void output(Sink sink, const uint8_t* data, int len)
+  {
+    if (sink==SINK_TEXT) {
+      if (serial_open) Serial.write(data, len);
+      if (logfile) logfile->write(data, len);
+    } else if (eventfile) {
+      eventfile->write(data, len);
+    }
+  }
+
+  void enqueue(Sink sink, const uint8_t* data, int len)
+  {
+    if (synchronous) {
+      output(sink, data, len);
+      return;
+    }
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    int entry = len + 2;
+    while (queue_size - queue_len < entry) {
+      if (drop_policy==DROP_NEWEST || queue_len==0) {
+        dropped_++;
+        __set_PRIMASK(primask);
+        return;
+      }
+      queue_len -= queue[(queue_head + 1) % queue_size] + 2;
+      queue_head = (queue_head + queue[(queue_head + 1) % queue_size] + 2) % queue_size;
+      dropped_++;
+    }
+    int tail = queue_head + queue_len;
+    queue[tail++ % queue_size] = sink;
+    queue[tail++ % queue_size] = len;
+    for (int i=0; i<len; i++) queue[tail++ % queue_size] = data[i];
+    queue_len += entry;
+    __set_PRIMASK(primask);
+  }
+
+  // Hand queued entries on until about budget bytes went out
+  void drain(int budget)
+  {
+    uint8_t entry[255];
+    while (budget > 0) {
+      uint32_t primask = __get_PRIMASK();
+      __disable_irq();
+      if (!queue_len) {
+        __set_PRIMASK(primask);
+        break;
+      }
+      Sink sink = (Sink)queue[queue_head];
+      int len = queue[(queue_head + 1) % queue_size];
+      for (int i=0; i<len; i++) entry[i] = queue[(queue_head + 2 + i) % queue_size];
+      queue_head = (queue_head + len + 2) % queue_size;
+      queue_len -= len + 2;
+      __set_PRIMASK(primask);
+
+      output(sink, entry, len);
+      budget -= len;
+    }
+
+    if (dropped_ != dropped_reported) {
+      char line[48];
+      int len = snprintf(line, sizeof(line), "logging> %lu entries dropped\r\n", dropped_ - dropped_reported);
+      dropped_reported = dropped_;
+      output(SINK_TEXT, (const uint8_t*)line, len);
+    }
+  }
+
   class LoggerImpl : public Logger
   {
     static const int buff_len = 100;
     char buff[buff_len+1];
     int  buff_idx = 0;
   public:
-    LoggerImpl(const String& id) : Logger(id) { buff[0] = 0; }
+    LoggerImpl(Id id) : Logger(id) { buff[0] = 0; }
 
-    void wrap() 
+    void emit(const char* ending)
     {
-      if (serial_open) {
-        Serial.print(id);
-        Serial.print("> ");
-        Serial.print(buff);
-        Serial.println("\\");
-      }
-      if (logfile) {
-        logfile->print(id);
-        logfile->print("> ");
-        logfile->print(buff);
-        logfile->println("\\");
-      }      
+      char line[128];
+      int len = std::min(snprintf(line, sizeof(line), "%s> %s%s", name(), buff, ending), (int)sizeof(line) - 1);
+      crashlog::note(line, len);
+      enqueue(SINK_TEXT, (const uint8_t*)line, len);
       buff_idx = 0;
       buff[0] = 0;
     }
 
+    void wrap() 
+    {
+      emit("\\\r\n");
+    }
+
     void linebreak()
     {
-      if (serial_open) {
-        Serial.println(String(id) + "> " + buff);
-      }
-      if (logfile) {
-        logfile->println(String(id) + "> " + buff);
-      }
-      buff_idx = 0;
-      buff[0] = 0;
+      emit("\r\n");
     }
 
     char prev_nl = 0;
     size_t write(uint8_t ch)
     {
+      if (!enabled(writing_at)) return 1;
       if (ch=='\n' || ch=='\r') {
         if (!(ch=='\n' && prev_nl=='\r')) linebreak();
         prev_nl = ch;
@@ -95,6 +171,7 @@ namespace logging
     void flush()
     {
       if (buff_idx) println();
+      drain(queue_size);
       if (serial_open) Serial.flush();
       if (logfile) logfile->flush();
     }
@@ -102,19 +179,136 @@ namespace logging
 
   };
 
-  std::vector<std::unique_ptr<LoggerImpl>> logger_pool;
-  Logger& get(const String& id) {
-    for (auto iter = logger_pool.begin(); iter!=logger_pool.end(); iter++)
-      if ((*iter)->id == id) return **iter;
-    logger_pool.emplace_back(std::unique_ptr<LoggerImpl>(new LoggerImpl(id)));
-    return *logger_pool.back();
+  const char* const names[ID_COUNT] = {
+#define LOGGING_NAME(id, name) name,
+    LOGGING_IDS(LOGGING_NAME)
+#undef LOGGING_NAME
+  };
+
+  // Function-local so that loggers fetched during static init of other files find it constructed
+  LoggerImpl* loggers()
+  {
+    static LoggerImpl table[ID_COUNT] = {
+#define LOGGING_IMPL(id, name) {id},
+      LOGGING_IDS(LOGGING_IMPL)
+#undef LOGGING_IMPL
+    };
+    return table;
+  }
+
+  Logger& get(Id id) {
+    assert(id < ID_COUNT);
+    return loggers()[id];
+  }
+
+  void setLevel(Id id, Level level)
+  {
+    get(id).level = level;
+  }
+
+  void setLevel(Level level)
+  {
+    for (int i=0; i<ID_COUNT; i++) loggers()[i].level = level;
   }
 
 
   void setLogfile(File* file)
   {
     logfile = file;
-    logfile->println("Logger attached");
+    has_output = true;
+    const char* attached = "Logger attached\r\n";
+    enqueue(SINK_TEXT, (const uint8_t*)attached, strlen(attached));
+  }
+
+  // The file starts with "EVT1", the number of loggers and their names, so a decoder does not
+  // have to know this build's logger table.
+  void setEventfile(File* file)
+  {
+    eventfile = file;
+    has_output = true;
+    eventfile->write((const uint8_t*)"EVT1", 4);
+    eventfile->write((uint8_t)ID_COUNT);
+    for (int i=0; i<ID_COUNT; i++) eventfile->write((const uint8_t*)names[i], strlen(names[i]) + 1);
   }
+
+  void writeEvent(Id id, Level at, const char* fmt, const uint8_t* args, uint8_t len, bool truncated)
+  {
+    if (!eventfile) return;
+    uint8_t record[12 + EventArgs::capacity];
+    uint32_t timestamp = millis();
+    uint32_t fmt_address = (uint32_t)fmt;
+    record[0] = 0xa5;
+    record[1] = id;
+    record[2] = at | (truncated ? event_truncated : 0);
+    record[3] = len;
+    memcpy(&record[4], &timestamp, 4);
+    memcpy(&record[8], &fmt_address, 4);
+    memcpy(&record[12], args, len);
+    enqueue(SINK_EVENT, record, 12 + len);
+  }
+
+  // Formats like Logger::logf; only the crash ring sees the text
+  void noteEvent(Id id, Level at, const char* fmt, ...)
+  {
+    char line[128];
+    int len = snprintf(line, sizeof(line), "%s> %s", get(id).name(), at < sizeof(level_prefixes) / sizeof(*level_prefixes) ? level_prefixes[at] : "");
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line + len, sizeof(line) - len, fmt, args);
+    va_end(args);
+    crashlog::note(line, strlen(line));
+  }
+
+  void update(unsigned long timestamp, unsigned long delta)
+  {
+    drain(drain_budget);
+  }
+
+  void setDropPolicy(DropPolicy policy)
+  {
+    drop_policy = policy;
+  }
+
+  unsigned long dropped()
+  {
+    return dropped_;
+  }
+
+  void setSynchronous(bool on)
+  {
+    if (on) drain(queue_size);
+    synchronous = on;
+  }
+
+  bool isSynchronous()
+  {
+    return synchronous;
+  }
+
+  void emergency()
+  {
+    setSynchronous(true);
+    if (serial_open) Serial.flush();
+    if (logfile) logfile->flush();
+    if (eventfile) eventfile->flush();
+  }
+}
+
+
+const char* Logger::name() const
+{
+  return logging::names[id];
+}
+
+void Logger::logf(logging::Level at, const char* fmt, ...)
+{
+  char buff[128];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buff, sizeof(buff), fmt, args);
+  va_end(args);
+  writing_at = at;
+  if (at < sizeof(logging::level_prefixes) / sizeof(*logging::level_prefixes)) print(logging::level_prefixes[at]);
+  println(buff);
+  writing_at = logging::LEVEL_INFO;
 }
-
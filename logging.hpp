@@ -1,21 +1,176 @@
 #pragma once
 #include "common.hpp"
 #include <SD.h>
+#include <type_traits>
+
+// Every logger in the firmware as (id, printed name). A new module adds its line here.
+#define LOGGING_IDS(X) \
+  X(MAIN, "main") \
+  X(COMMON, "common") \
+  X(WATCHDOG, "watchdog") \
+  X(FLASHLOG, "flashlog") \
+  X(SIMCOM, "simcom") \
+  X(GSM, "gsm") \
+  X(GSM_TX, "gsm-tx") \
+  X(GSM_RX, "gsm-rx") \
+  X(HTTP, "http") \
+  X(GPS, "gps") \
+  X(GPS_TX, "gps-tx") \
+  X(GPS_RX, "gps-rx") \
+  X(I2C, "i2c") \
+  X(IMU, "imu") \
+  X(IMUSIM, "imusim") \
+  X(FLIGHT, "flight") \
+  X(PRETRIGGER, "pretrigger") \
+  X(AGGREGATE, "aggregate") \
+  X(CRASHLOG, "crashlog") \
+  X(TIMEBASE, "timebase") \
+  X(POWER, "power") \
+  X(TCP, "tcp") \
+  X(UPLINK, "uplink")
+
+namespace logging
+{
+  enum Id : uint8_t {
+#define LOGGING_ENUM(id, name) id,
+    LOGGING_IDS(LOGGING_ENUM)
+#undef LOGGING_ENUM
+    ID_COUNT
+  };
+
+  enum Level : uint8_t {
+    LEVEL_VERBOSE = 0,
+    LEVEL_INFO,
+    LEVEL_WARNING,
+    LEVEL_ERROR,
+    LEVEL_OFF
+  };
+
+  extern bool has_output; // serial open or log file attached
+}
 
 class Logger : public Print {
+protected:
+  logging::Level writing_at = logging::LEVEL_INFO;
 public:
-  String id;
-  Logger(const String& id) : id(id) {}
-  virtual size_t write(uint8_t ch) = 0;
+  const logging::Id id;
+  logging::Level level = logging::LEVEL_INFO; // lowest level that gets through
+  Logger(logging::Id id) : id(id) {}
+  const char* name() const;
+  // check before building a message; plain print/println count as LEVEL_INFO
+  bool enabled(logging::Level at = logging::LEVEL_INFO) const { return at >= level && logging::has_output; }
+  // one line, formatted into a stack buffer; use through the LOG_* macros so arguments are only
+  // evaluated when enabled. No %f: newlib-nano's printf is built without float support.
+  void logf(logging::Level at, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+  virtual size_t write(uint8_t ch) = 0; // gated on enabled(writing_at)
   virtual size_t write(const uint8_t *buffer, size_t size) = 0;
   virtual void flush() = 0;
 };
 
+#ifdef LOG_BINARY
+#define LOG_AT(logger, at, ...) do { if ((logger).enabled(at)) logging::event((logger).id, at, __VA_ARGS__); } while(0)
+#else
+#define LOG_AT(logger, at, ...) do { if ((logger).enabled(at)) (logger).logf(at, __VA_ARGS__); } while(0)
+#endif
+#define LOG_VERBOSE(logger, ...) LOG_AT(logger, logging::LEVEL_VERBOSE, __VA_ARGS__)
+#define LOG_INFO(logger, ...) LOG_AT(logger, logging::LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARNING(logger, ...) LOG_AT(logger, logging::LEVEL_WARNING, __VA_ARGS__)
+#define LOG_ERROR(logger, ...) LOG_AT(logger, logging::LEVEL_ERROR, __VA_ARGS__)
+
 namespace logging
 {
-  void begin();
-  Logger& get(const String& id);
+  // When the queue of pending output is full: lose what is already queued, or what is being logged
+  enum DropPolicy : uint8_t {
+    DROP_OLDEST,
+    DROP_NEWEST
+  };
+
+  void begin(bool wait_for_serial = true);
+  void update(unsigned long timestamp, unsigned long delta); // hands queued output to Serial and SD
+  void setDropPolicy(DropPolicy policy);
+  unsigned long dropped();
+  void setSynchronous(bool on); // on while setup() runs, since nothing calls update() yet
+  bool isSynchronous();
+  void emergency(); // drain everything now and write synchronously from here on; for assert and reboot
+  Logger& get(Id id);
+  void setLevel(Id id, Level level);
+  void setLevel(Level level); // all loggers
   void setLogfile(File* file);
+
+  // Binary event log. A record is
+  //   u8 0xa5, u8 logger id, u8 level, u8 argument bytes, u32 millis, u32 format string address, arguments
+  // little-endian, with integers packed as 4 bytes, float/double as a 4-byte float and strings as
+  // u8 length + bytes. The format strings stay in flash; tools/logdecode.py looks them up in the ELF.
+  // Strings are cut short to fit the arguments buffer; arguments that still do not fit are left
+  // out and the level gets event_truncated set.
+  const uint8_t event_truncated = 0x80;
+  void setEventfile(File* file);
+  void writeEvent(Id id, Level at, const char* fmt, const uint8_t* args, uint8_t len, bool truncated);
+  void noteEvent(Id id, Level at, const char* fmt, ...); // the crash ring keeps text in either mode
+
+  struct EventArgs
+  {
+    static const int capacity = 48;
+    uint8_t buff[capacity];
+    uint8_t len = 0;
+    bool truncated = false;
+    uint8_t room() const { return capacity - len; }
+    void put(const void* data, uint8_t size)
+    {
+      if (size > room()) {
+        truncated = true;
+        return;
+      }
+      memcpy(buff + len, data, size);
+      len += size;
+    }
+  };
+
+  template<typename T>
+  typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type pack(EventArgs& args, T value)
+  {
+    int32_t v = (int32_t)value;
+    args.put(&v, 4);
+  }
+
+  template<typename T>
+  typename std::enable_if<std::is_floating_point<T>::value>::type pack(EventArgs& args, T value)
+  {
+    float v = value;
+    args.put(&v, 4);
+  }
+
+  template<typename T>
+  void pack(EventArgs& args, const T* value) // %p
+  {
+    uint32_t v = (uint32_t)value;
+    args.put(&v, 4);
+  }
+
+  inline void pack(EventArgs& args, const char* value)
+  {
+    uint8_t len = strnlen(value, args.room() ? std::min(32, args.room() - 1) : 0);
+    if (len < strnlen(value, 32)) args.truncated = true;
+    args.put(&len, 1);
+    args.put(value, len);
+  }
+
+  inline void packAll(EventArgs& args) {}
+
+  template<typename T, typename... Rest>
+  void packAll(EventArgs& args, T value, Rest... rest)
+  {
+    pack(args, value);
+    packAll(args, rest...);
+  }
+
+  template<typename... Args>
+  void event(Id id, Level at, const char* fmt, Args... values)
+  {
+    EventArgs args;
+    packAll(args, values...);
+    noteEvent(id, at, fmt, values...);
+    writeEvent(id, at, fmt, args.buff, args.len, args.truncated);
+  }
 }
 
-
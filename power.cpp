@@ -0,0 +1,92 @@
+#include "power.hpp"
+#include "logging.hpp"
+#include "timebase.hpp"
+#include "flight.hpp"
+
+namespace power
+{
+  Logger& logger = logging::get(logging::POWER);
+
+  // SAMD21 at 48 MHz from the datasheet, in tenths of a mA; the MCU alone, modem, GPS and IMU come on top
+  const uint32_t active_ma10 = 65;
+  const uint32_t idle_ma10 = 25;
+  const int phases = flight::LANDED + 1;
+
+  uint32_t last_wake_us = 0;
+  uint32_t window_awake_us = 0;
+  uint32_t window_asleep_us = 0;
+  int duty = 100;
+
+  // per flight phase, for comparing profiles; interrupt handlers count as asleep
+  uint64_t awake_us[phases];
+  uint64_t asleep_us[phases];
+  int last_phase = flight::PAD;
+
+
+  int percent(uint64_t part, uint64_t total)
+  {
+    return total ? (int)(part * 100 / total) : 0;
+  }
+
+  unsigned long currentMa10(uint64_t awake, uint64_t asleep)
+  {
+    uint64_t total = awake + asleep;
+    return total ? (unsigned long)((awake * active_ma10 + asleep * idle_ma10) / total) : 0;
+  }
+
+  void summarise(int phase)
+  {
+    unsigned long ma10 = currentMa10(awake_us[phase], asleep_us[phase]);
+    LOG_INFO(logger, "In %s for %lus: CPU awake %d%%, about %lu.%lumA", flight::phaseName((flight::Phase)phase), (unsigned long)((awake_us[phase] + asleep_us[phase]) / 1000000),
+      percent(awake_us[phase], awake_us[phase] + asleep_us[phase]), ma10 / 10, ma10 % 10);
+  }
+
+  void begin()
+  {
+    SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+    PM->SLEEP.reg = PM_SLEEP_IDLE_CPU; // CPU clock only; AHB and APB keep running for the DMAC and SERCOMs
+    last_wake_us = timebase::now_us();
+    last_phase = flight::phase();
+  }
+
+  void idle(unsigned long ms)
+  {
+    uint32_t start = timebase::now_us();
+    int phase = flight::phase();
+    if (phase != last_phase) {
+      summarise(last_phase);
+      last_phase = phase;
+    }
+    uint32_t awake = start - last_wake_us;
+
+    uint32_t limit = ms * 1000;
+    uint32_t now = start;
+    while (now - start < limit) {
+      __DSB();
+      __WFI();
+      now = timebase::now_us();
+    }
+
+    uint32_t asleep = now - start;
+    awake_us[phase] += awake;
+    asleep_us[phase] += asleep;
+    window_awake_us += awake;
+    window_asleep_us += asleep;
+    last_wake_us = now;
+  }
+
+  void report()
+  {
+    duty = percent(window_awake_us, window_awake_us + window_asleep_us);
+    unsigned long ma10 = currentMa10(window_awake_us, window_asleep_us);
+    LOG_INFO(logger, "CPU awake %d%% in %s, about %lu.%lumA", duty, flight::phaseName(flight::phase()), ma10 / 10, ma10 % 10);
+    window_awake_us = 0;
+    window_asleep_us = 0;
+  }
+
+  int dutyPercent()
+  {
+    return duty;
+  }
+}
+
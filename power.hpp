@@ -0,0 +1,15 @@
+#pragma once
+#include "common.hpp"
+
+// Sleep between passes of the main loop instead of spinning in delay(). Only IDLE is used: the
+// UARTs, the I2C DMA and the timebase all run off the 48 MHz clock that STANDBY would stop, so
+// every interrupt (SysTick each millisecond, SERCOM RX, DMAC, IMU data ready) wakes the CPU,
+// its handler runs as usual and no byte or sample is lost while we sleep.
+namespace power
+{
+  void begin(); // after timebase::begin
+  void idle(unsigned long ms);
+  void report();
+  int dutyPercent(); // share of time the CPU was awake over the last report interval
+}
+
@@ -0,0 +1,64 @@
+#include "pretrigger.hpp"
+#include "logging.hpp"
+
+namespace pretrigger
+{
+  Logger& logger = logging::get(logging::PRETRIGGER);
+
+  Record ring[capacity];
+  int head = 0; // oldest record
+  int len = 0;
+  bool triggered_ = false;
+  unsigned long dropped_ = 0;
+
+  void push(unsigned long timestamp, uint32_t sample_us, const imu::Data& data, uint8_t phase)
+  {
+    if (len == capacity) {
+      if (triggered_) {
+        dropped_++;
+        return;
+      }
+      head = (head + 1) % capacity;
+      len--;
+    }
+    Record& record = ring[(head + len) % capacity];
+    record.timestamp = timestamp;
+    record.sample_us = sample_us;
+    record.data = data;
+    record.phase = phase;
+    len++;
+  }
+
+  void trigger()
+  {
+    if (triggered_) return;
+    triggered_ = true;
+    if (len) LOG_INFO(logger, "Triggered with %d samples, from %lums", len, (unsigned long)ring[head].timestamp);
+    else LOG_INFO(logger, "Triggered with no history");
+  }
+
+  bool triggered()
+  {
+    return triggered_;
+  }
+
+  bool pop(Record& record)
+  {
+    if (!len) return false;
+    record = ring[head];
+    head = (head + 1) % capacity;
+    len--;
+    return true;
+  }
+
+  int size()
+  {
+    return len;
+  }
+
+  unsigned long dropped()
+  {
+    return dropped_;
+  }
+}
+
@@ -0,0 +1,28 @@
+#pragma once
+#include "common.hpp"
+#include "imu.hpp"
+
+// Full-rate IMU history kept in RAM while we sit on the pad, so the first moments of boost
+// survive launch detection without writing every sample to SD for hours.
+namespace pretrigger
+{
+  struct Record
+  {
+    uint32_t timestamp;
+    uint32_t sample_us; // timebase capture of the data ready edge
+    imu::Data data;
+    uint8_t phase;
+  };
+
+  const int capacity = 200; // 1 s at 200 Hz, 28 bytes per record
+
+  // Before trigger() the oldest record is overwritten; after it, records queue up behind the
+  // history until popped, and are dropped (and counted) if that runs out of room.
+  void push(unsigned long timestamp, uint32_t sample_us, const imu::Data& data, uint8_t phase);
+  void trigger();
+  bool triggered();
+  bool pop(Record& record);
+  int size();
+  unsigned long dropped();
+}
+
@@ -0,0 +1,184 @@
+#include "tcp.hpp"
+#include "gsm.hpp"
+#include "logging.hpp"
+
+namespace tcp
+{
+  Logger& logger = logging::get(logging::TCP);
+
+  using namespace gsm;
+
+  class Socket
+  {
+    enum State
+    {
+      CLOSED,
+      OPENING,    // CIPSHUT .. CIPSTART queued or running
+      CONNECTING, // CIPSTART accepted, waiting for CONNECT OK
+      OPEN
+    } state = CLOSED;
+
+    const unsigned long retry_ms = 5000;
+    const unsigned long connect_timeout_ms = 30000;
+
+    String host;
+    uint16_t port = 0;
+    bool udp = false;
+    bool sending = false;
+    unsigned long last_attempt = 0;
+    unsigned long connecting_since = 0;
+
+    bool unsolicitedMessageHandler(const String& msg)
+    {
+      if (msg=="CONNECT OK" || msg=="ALREADY CONNECT") {
+        if (state==OPENING || state==CONNECTING) {
+          LOG_INFO(logger, "Connected to %s:%u", host.c_str(), port);
+          state = OPEN;
+        }
+        return true;
+      }
+      if (msg=="CONNECT FAIL") {
+        LOG_WARNING(logger, "Could not connect to %s:%u", host.c_str(), port);
+        state = CLOSED;
+        return true;
+      }
+      if (msg=="CLOSED") {
+        LOG_WARNING(logger, "Closed by the other end");
+        state = CLOSED;
+        return true;
+      }
+      if (msg.startsWith("+PDP: DEACT")) {
+        if (state!=CLOSED) LOG_WARNING(logger, "PDP context deactivated");
+        state = CLOSED;
+        return false; // gsm wants to know too
+      }
+      return false;
+    }
+
+    void open()
+    {
+      state = OPENING;
+      LOG_INFO(logger, "Opening %s %s:%u", udp ? "UDP" : "TCP", host.c_str(), port);
+      gsm::runner()->then(
+        "AT+CIPSHUT", 5000, // back to IP INITIAL whatever state the stack was left in
+        [](const String& msg, Runner* r) {
+          if (msg=="SHUT OK") return OK;
+          else if (msg=="ERROR") return ERROR;
+          return NOP;
+        }
+      )->then(
+        String("AT+CIPMUX=0;+CSTT=\"") + gsm::apn() + "\"", 1000
+      )->then(
+        "AT+CIICR", 60000
+      )->then(
+        "AT+CIFSR", 2000, // answers with our address and no OK
+        [](const String& msg, Runner* r) {
+          if (msg=="ERROR") return ERROR;
+          else if (msg.indexOf('.') > 0) return OK;
+          return NOP;
+        }
+      )->then(
+        String("AT+CIPSTART=\"") + (udp ? "UDP" : "TCP") + "\",\"" + host + "\",\"" + String(port) + "\"", 5000
+      )->sync(
+        [this](bool failed, Runner* r) {
+          if (failed) {
+            LOG_WARNING(logger, "Failed to open socket");
+            state = CLOSED;
+          } else if (state==OPENING) {
+            state = CONNECTING;
+            connecting_since = millis();
+          }
+          return NOP;
+        }
+      );
+    }
+
+  public:
+    void begin(const char* host, uint16_t port, bool udp)
+    {
+      this->host = host;
+      this->port = port;
+      this->udp = udp;
+      gsm::addUnsolicitedHandler([this](const String& msg) { return unsolicitedMessageHandler(msg); });
+    }
+
+    void update(unsigned long timestamp, unsigned long delta)
+    {
+      if (!port) return;
+      if (state==CONNECTING && timestamp - connecting_since > connect_timeout_ms) {
+        LOG_WARNING(logger, "Timed out connecting");
+        state = CLOSED;
+      }
+      if (state==CLOSED && gsm::isConnected() && timestamp - last_attempt >= retry_ms) {
+        last_attempt = timestamp;
+        open();
+      }
+    }
+
+    bool isOpen()
+    {
+      return state==OPEN;
+    }
+
+    bool isSending()
+    {
+      return sending;
+    }
+
+    void send(const uint8_t* data, size_t len, std::function<void(bool)> done_callback)
+    {
+      if (state!=OPEN) {
+        done_callback(true);
+        return;
+      }
+      sending = true;
+      gsm::runner()->thenData(
+        String("AT+CIPSEND=") + String(len), data, len, 10000,
+        [](const String& msg, Runner* r) {
+          if (msg=="SEND OK") return OK;
+          else if (msg=="SEND FAIL" || msg=="ERROR") return ERROR;
+          return NOP;
+        }
+      )->sync(
+        [this, done_callback](bool failed, Runner* r) {
+          if (failed && state==OPEN) {
+            LOG_WARNING(logger, "Send failed, reopening");
+            state = CLOSED;
+          }
+          sending = false;
+          done_callback(failed);
+          return NOP;
+        }
+      );
+    }
+  };
+
+
+  Socket socket_obj;
+
+  void begin(const char* host, uint16_t port, bool udp)
+  {
+    socket_obj.begin(host, port, udp);
+  }
+
+  void update(unsigned long timestamp, unsigned long delta)
+  {
+    socket_obj.update(timestamp, delta);
+  }
+
+  bool isOpen()
+  {
+    return socket_obj.isOpen();
+  }
+
+  bool isSending()
+  {
+    return socket_obj.isSending();
+  }
+
+  void send(const uint8_t* data, size_t len, std::function<void(bool)> done_callback)
+  {
+    socket_obj.send(data, len, done_callback);
+  }
+}
+
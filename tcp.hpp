@@ -0,0 +1,17 @@
+#pragma once
+#include "common.hpp"
+#include <functional>
+
+// Telemetry over a socket the modem keeps open (AT+CIPSTART, then AT+CIPSEND per frame), as the
+// alternative to http: instead of a DNS lookup, TCP handshake, HTTP headers and teardown for every
+// sample, only the frame and the TCP/IP headers around it go on air. The socket is reopened when
+// the modem reports it CLOSED or the PDP context deactivated.
+namespace tcp
+{
+  void begin(const char* host, uint16_t port, bool udp = false);
+  void update(unsigned long timestamp, unsigned long delta);
+  bool isOpen();
+  bool isSending();
+  void send(const uint8_t* data, size_t len, std::function<void(bool err)> done_callback);
+}
+
@@ -8,10 +8,24 @@
 #include "watchdog.hpp"
 #include "flashlog.hpp"
 #include "imu.hpp"
-#include <Wire.h>
+#include "i2c.hpp"
+#include "flight.hpp"
+#include "pretrigger.hpp"
+#include "aggregate.hpp"
+#include "crashlog.hpp"
+#include "timebase.hpp"
+#include "power.hpp"
+#include "uplink.hpp"
+#include <stdarg.h>
+#ifdef TELEMETRY_TCP
+#include "tcp.hpp"
+#endif
+#ifdef IMU_SIM
+#include "imusim.hpp"
+#endif
 
 namespace {
-  Logger& logger = logging::get("main");
+  Logger& logger = logging::get(logging::MAIN);
   
   float readBatteryVoltage()
   {
@@ -28,13 +42,28 @@ static const String publicKey = "roMd2jR96OTpEAb4jG1y";
 static const String privateKey = "jk9NvjPKE6Ug1rq0P6NY";
 static const String inputUrl = "http://data.sparkfun.com/input/"+publicKey+"?private_key="+privateKey;
 
+#ifdef TELEMETRY_TCP
+// where tools/groundstation.py listens
+static const char* const telemetry_host = "telemetry.example.org";
+static const uint16_t telemetry_port = 7373;
+static const bool telemetry_udp = false;
+#endif
+
 // how long do we accept not having uploaded any telemetry before we reboot
 static unsigned long first_send_deadline = 125000;
 static unsigned long silence_deadline = 65000;
 
+// the modem falls asleep after 5 s of quiet, so with shorter upload intervals sleep would only add wake-up latency
+static const unsigned long modem_sleep_min_upload_ms = 10000;
+
 
 
 void setup() {
+  // After a watchdog reset out of a running session, check the peripherals rather than
+  // reinitialising them and keep writing the same files, so logging resumes in well under a second.
+  crashlog::begin();
+  bool warm = crashlog::warmStart();
+  const crashlog::Resume& resume = crashlog::resume();
 
   pinMode(PIN_LED, OUTPUT);
   digitalWrite(PIN_LED, HIGH);
@@ -42,71 +71,228 @@ void setup() {
 
   watchdog::begin();
   
-  logging::begin();
+  logging::begin(!warm);
   logger.println("Hey there display!");
   
-  flashlog::begin();
+  flashlog::begin(warm ? resume.file_index : -1);
   logger.println("Hey there flash too!");
+  crashlog::report();
+  crashlog::setFileIndex(flashlog::index());
+  uplink::begin(warm ? &resume : nullptr);
 
-  Wire.begin(); // Start Wire (I2C)
-  sercom3.disableWIRE(); // Disable the I2C bus
-  SERCOM3->I2CM.BAUD.bit.BAUD = SystemCoreClock / ( 2 * 400000) - 1; // Set the I2C SCL frequency to 400kHz
-  sercom3.enableWIRE(); // Restart the I2C bus
+  i2c::begin(400000); // Start I2C with SCL at 400kHz and the DMA channel for IMU reads
 
   watchdog::tickle();
-  bool imu_ok = imu::begin();
+  bool imu_ok = imu::begin(warm ? resume.mag_adjust : nullptr);
   if (!imu_ok) {
     logger.println("Could not initialize IMU - rebooting");
-    watchdog::reboot();
+    watchdog::reboot("imu init failed");
+  }
+  crashlog::setMagAdjust(imu::magAdjustment());
+  power::begin();
+  if (warm) {
+    flight::resume((flight::Phase)resume.phase);
+    if (flight::phase()!=flight::PAD) pretrigger::trigger(); // nothing to keep, log directly
   }
   watchdog::tickle();
-  simcom::begin();
+  simcom::begin(warm);
+#ifdef TELEMETRY_TCP
+  tcp::begin(telemetry_host, telemetry_port, telemetry_udp);
+#endif
   watchdog::tickle();
-  flashlog::gpsFile()->println("logtime,gga_time,fix,latitude,longitude,altitude,accuracy_time,accuracy");
+
+  if (warm) {
+    // millis() starts over, so mark where logtime jumps back
+    String marker = String("# warm restart, boot ") + String(crashlog::bootCount());
+    flashlog::gpsFile()->println(marker);
+    flashlog::sensorFile()->println(marker);
+    crashlog::setRunning(true);
+    logger.println("Warm restart done!");
+    logging::setSynchronous(false);
+    watchdog::tickle();
+    return;
+  }
+
+  flashlog::gpsFile()->println("# utc is seconds since 1970, empty until GPS or network time is known");
+  flashlog::gpsFile()->println("logtime,utc,gga_time,fix,latitude,longitude,altitude,accuracy_time,accuracy");
   watchdog::tickle();
 
-  flashlog::sensorFile()->println("ax,ay,az,gx,gy,gz,mx,my,mz");
+  flashlog::sensorFile()->println(String("# raw counts; g/LSB ") + String(imu::aRes, 9) + ", dps/LSB " + String(imu::gRes, 9) + ", mG/LSB " + String(imu::mRes, 9) + "; utc as in the gps file");
+  // a row is one aggregation window of n samples: the axis columns are window means, min/max/rms follow the attitude
+  String header = "logtime,sample_us,utc,phase,n,ax,ay,az,gx,gy,gz,mx,my,mz,roll,pitch,yaw,q0,q1,q2,q3";
+  static const char* const axis_names[aggregate::axes] = {"ax", "ay", "az", "gx", "gy", "gz", "mx", "my", "mz"};
+  for (const char* stat : {"_min", "_max", "_rms"}) {
+    for (const char* axis : axis_names) header += String(",") + axis + stat;
+  }
+  flashlog::sensorFile()->println(header);
 
+  crashlog::setRunning(true);
   logger.println("Initialization done!");
+  logging::setSynchronous(false);
   watchdog::tickle();
 }
 
 static unsigned long last_send_timestamp = 0;
-static void sendData(unsigned long timestamp)
+
+// For comparing the transports: how long an upload takes from queueing to acknowledgement, and
+// roughly what it costs on air (payload plus the TCP/IP headers, handshake and teardown around it)
+struct UploadStats
+{
+  unsigned long ok = 0;
+  unsigned long failed = 0;
+  unsigned long latency_ms = 0;
+  unsigned long bytes = 0;
+} upload_stats;
+
+static void uploadDone(unsigned long timestamp, bool ok, size_t bytes)
+{
+  if (ok) {
+    upload_stats.ok++;
+    upload_stats.latency_ms += millis() - timestamp;
+    last_send_timestamp = timestamp;
+  } else {
+    upload_stats.failed++;
+  }
+  upload_stats.bytes += bytes;
+}
+
+static void reportUploads()
+{
+#ifdef TELEMETRY_TCP
+  const char* transport = telemetry_udp ? "udp" : "tcp";
+#else
+  const char* transport = "http";
+#endif
+  LOG_INFO(logger, "Uploads over %s: %lu ok, %lu failed, %lums on average, about %lu bytes on air", transport, upload_stats.ok, upload_stats.failed,
+    upload_stats.ok ? upload_stats.latency_ms / upload_stats.ok : 0UL, upload_stats.bytes);
+  upload_stats = UploadStats();
+}
+
+static void takeSample(unsigned long timestamp)
 {
-  
   gps::GpsData gps_data = gps::get();
+  const uplink::Policy& policy = uplink::policy();
+  const uplink::Metrics& metrics = uplink::metrics();
+
+  uplink::Frame frame;
+  frame.logtime = timestamp;
+  uint64_t utc_ms = 0;
+  timebase::utc(timebase::now_us(), utc_ms);
+  frame.utc_s = utc_ms / 1000;
+  frame.utc_ms = utc_ms % 1000;
+  frame.phase = flight::phase();
+  frame.cpu_duty = power::dutyPercent();
+  frame.voltage_mv = readBatteryVoltage() * 1000;
+  frame.free_ram = freeRam();
+  frame.fix = gps_data.fix;
+  frame.utc_source = timebase::utcSource();
+  frame.latitude_e6 = uplink::toFixed(gps_data.latitude, 6);
+  frame.longitude_e6 = uplink::toFixed(gps_data.longitude, 6);
+  frame.altitude_dm = uplink::toFixed(gps_data.altitude, 1);
+  frame.accuracy_dm = uplink::toFixed(gps_data.accuracy, 1);
+  frame.csq = metrics.csq;
+  frame.link = policy.link;
+  frame.batch = policy.batch;
+  frame.fail_pct = metrics.fail_pct;
+  frame.latency_ms = std::min(metrics.latency_ms, 65535UL);
+
+  uplink::push(frame);
+}
+
+static void uploaded(unsigned long timestamp, bool ok, int count, size_t bytes)
+{
+  uplink::sent(ok);
+  if (ok) {
+    LOG_INFO(logger, "Uploaded %d samples at %lus", count, timestamp/1000);
+  } else {
+    LOG_WARNING(logger, "Upload of %d samples failed at %lus", count, timestamp/1000);
+  }
+  uplink::result(ok, millis() - timestamp);
+  uploadDone(timestamp, ok, bytes);
+}
 
-  // generate string
-  String url = inputUrl;
-  url += "&seconds=" + String(timestamp / 1000);
-  url += "&voltage=" + String(readBatteryVoltage()) + "&free_ram=" + String(freeRam());
-  url += String("") + "&gps_fix=" + String(gps_data.fix) + "&gps_altitude=" + gps_data.altitude + "&gps_latitude=" + gps_data.latitude + "&gps_longitude=" + gps_data.longitude + "&gps_accuracy=" + gps_data.accuracy;
+static String httpFields(const uplink::Frame& frame)
+{
+  String fields;
+  fields += "&seq=" + String(frame.seq) + "&seconds=" + String(frame.logtime / 1000);
+  fields += String("&phase=") + flight::phaseName((flight::Phase)frame.phase);
+  fields += "&voltage=" + uplink::fromFixed(frame.voltage_mv, 3) + "&free_ram=" + String(frame.free_ram) + "&cpu_duty=" + String(frame.cpu_duty);
+  fields += "&gps_fix=" + String(frame.fix) + "&gps_altitude=" + uplink::fromFixed(frame.altitude_dm, 1) + "&gps_latitude=" + uplink::fromFixed(frame.latitude_e6, 6)
+    + "&gps_longitude=" + uplink::fromFixed(frame.longitude_e6, 6) + "&gps_accuracy=" + uplink::fromFixed(frame.accuracy_dm, 1);
+  fields += "&csq=" + String(frame.csq) + "&link=" + uplink::linkName((uplink::Link)frame.link) + "&batch=" + String(frame.batch)
+    + "&latency=" + String(frame.latency_ms) + "&fail=" + String(frame.fail_pct);
+  return fields;
+}
+
+// Newest sample first, then as much of the backlog as the policy allows
+static void sendData(unsigned long timestamp)
+{
+#ifdef TELEMETRY_TCP
+  if (!tcp::isOpen() || tcp::isSending()) return;
+#else
+  if (!gsm::isConnected() || http::isRequesting()) return;
+#endif
+  std::vector<uplink::Frame> frames = uplink::take(uplink::policy().batch);
+  int count = frames.size();
+  if (!count) return;
+
+#ifdef TELEMETRY_TCP
+  std::vector<uint8_t> data;
+  for (const uplink::Frame& frame : frames) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&frame);
+    data.insert(data.end(), bytes, bytes + sizeof(uplink::Frame));
+  }
+  size_t bytes = data.size() + (telemetry_udp ? 28 : 40 + 40); // IP+UDP, or IP+TCP plus the ACK
+  tcp::send(
+    data.data(), data.size(),
+    [timestamp, count, bytes](bool err) {
+      uploaded(timestamp, !err, count, bytes);
+    }
+  );
+  return;
+#endif
+
+  // The first sample goes in the usual fields, the rest as rows of
+  // seq,seconds,gps_fix,gps_latitude,gps_longitude,gps_altitude in "backfill"
+  String url = inputUrl + httpFields(frames[0]);
+  if (count > 1) {
+    url += "&backfill=";
+    for (int i = 1; i < count; i++) {
+      const uplink::Frame& frame = frames[i];
+      if (i > 1) url += ";";
+      url += String(frame.seq) + "," + String(frame.logtime / 1000) + "," + String(frame.fix) + "," + uplink::fromFixed(frame.latitude_e6, 6) + ","
+        + uplink::fromFixed(frame.longitude_e6, 6) + "," + uplink::fromFixed(frame.altitude_dm, 1);
+    }
+  }
  
+  // the URL plus headers, response and the TCP handshake and teardown around them
+  size_t request_bytes = url.length() + 600;
+
   // upload
-  if (gsm::isConnected() && !http::isRequesting()) {
-    http::rqGet(
-      url, 
-      [timestamp](bool err, int status) { 
-        if (!err && (status==200 || status==201 || status==202)) {
-          logger.println(String("Uploaded telemetry at ") + String(timestamp/1000) + "s");
-          last_send_timestamp = timestamp;
-        } else if (!err) {
-          logger.println(String("Upload failed with status ") + String(status) + " at " + String(timestamp/1000) + "s");
-        } else {
-          logger.println(String("Upload failed at ") + String(timestamp/1000) + "s");
-          gsm::connectionFailed();
-        }
+  http::rqGet(
+    url, 
+    [timestamp, count, request_bytes](bool err, int status) { 
+      if (!err && (status==200 || status==201 || status==202)) {
+        uploaded(timestamp, true, count, request_bytes);
+      } else if (!err) {
+        LOG_WARNING(logger, "Upload failed with status %d", status);
+        uploaded(timestamp, false, count, request_bytes);
+        if (status >= 600) gsm::connectionFailed(); // 601 network error, 603 DNS error etc.
+      } else {
+        uploaded(timestamp, false, count, request_bytes);
+        gsm::connectionFailed();
       }
-    );
-  }
+    }
+  );
     
 }
 
 
 void every_30s(unsigned long timestamp)
 {
-  gsm::maintainConnection();
+  gsm::report();
+  reportUploads();
+  uplink::report();
 }
 
 
@@ -114,10 +300,15 @@ void every_30s(unsigned long timestamp)
 // called every 10 seconds
 void every_10s(unsigned long timestamp)
 {
-  sendData(timestamp);
-
   watchdog::tickle();
  
+#ifdef IMU_SIM
+  imusim::report();
+#endif
+  timebase::report();
+  imu::report();
+  power::report();
+
   logger.println("Flushing flash..");
   flashlog::flush();
   logger.println("done.");
@@ -130,9 +321,6 @@ void every_1s(unsigned long timestamp)
   static bool led_val = false;
   digitalWrite(PIN_LED, led_val);
   led_val = !led_val;
-
-  const gps::GpsData& gps_data = gps::get();
-  flashlog::gpsFile()->println(String(timestamp) + "," + String(gps_data.gga_time) + "," + String(gps_data.fix) + "," + gps_data.latitude + "," + gps_data.longitude + "," + gps_data.altitude + "," + gps_data.accuracy_time + "," + gps_data.accuracy);
 }
 
 
@@ -141,11 +329,76 @@ void every_10th_s(unsigned long timestamp)
 {
   // keep watchdog timer happy
   watchdog::tickle();
+}
+
 
-  imu::update();
+// Sensor rows are written for every sample in flight, so they are formatted into a fixed buffer
+// like Logger::logf rather than built up from Strings
+struct Row
+{
+  char buff[512];
+  size_t len = 0;
+
+  void appendf(const char* fmt, ...) __attribute__((format(printf, 2, 3)))
+  {
+    if (len >= sizeof(buff) - 1) return;
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buff + len, sizeof(buff) - len, fmt, args);
+    va_end(args);
+    if (n > 0) len = std::min(len + n, sizeof(buff) - 1);
+  }
 
-  imu::Data imu_data = imu::get();
-  flashlog::sensorFile()->println(String(imu_data.ax) + "," + String(imu_data.ay) + "," + String(imu_data.az) + "," + String(imu_data.gx) + "," + String(imu_data.gy) + "," + String(imu_data.gz) + "," + String(imu_data.mx) + "," + String(imu_data.my) + "," + String(imu_data.mz));
+  // no %f in newlib-nano's printf
+  void appendFixed(float value, int decimals)
+  {
+    if (isnan(value)) return appendf(",nan");
+    unsigned long scale = 1;
+    for (int i = 0; i < decimals; i++) scale *= 10;
+    long v = lroundf(value * scale);
+    unsigned long abs = v < 0 ? -(unsigned long)v : v;
+    appendf(",%s%lu.%0*lu", v < 0 ? "-" : "", abs / scale, decimals, abs % scale);
+  }
+
+  // the columns every row starts with; a member so the sketch's generated prototypes never need Row
+  void appendSensors(unsigned long timestamp, uint32_t sample_us, int phase, int count, const imu::Data& imu_data)
+  {
+    char utc[16];
+    timebase::formatUtc(sample_us, utc, sizeof(utc));
+    appendf("%lu,%lu,%s,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d", timestamp, (unsigned long)sample_us, utc, phase, count,
+      imu_data.ax, imu_data.ay, imu_data.az, imu_data.gx, imu_data.gy, imu_data.gz, imu_data.mx, imu_data.my, imu_data.mz);
+  }
+};
+
+
+static void logSensors(const aggregate::Window& window)
+{
+  const int16_t* mean = window.mean;
+  imu::Data imu_data = {mean[0], mean[1], mean[2], mean[3], mean[4], mean[5], mean[6], mean[7], mean[8]};
+  imu::Attitude att = imu::get_attitude();
+  Row row;
+  row.appendSensors(window.timestamp, window.sample_us, flight::phase(), window.count, imu_data);
+  row.appendFixed(att.roll, 1);
+  row.appendFixed(att.pitch, 1);
+  row.appendFixed(att.yaw, 1);
+  row.appendFixed(att.q0, 4);
+  row.appendFixed(att.q1, 4);
+  row.appendFixed(att.q2, 4);
+  row.appendFixed(att.q3, 4);
+  if (window.count > 1) {
+    for (int i=0; i<aggregate::axes; i++) row.appendf(",%d", window.min[i]);
+    for (int i=0; i<aggregate::axes; i++) row.appendf(",%d", window.max[i]);
+    for (int i=0; i<aggregate::axes; i++) row.appendFixed(window.rms[i], 1);
+  }
+  flashlog::sensorFile()->println(row.buff);
+}
+
+
+static void logGps(unsigned long timestamp)
+{
+  const gps::GpsData& gps_data = gps::get();
+  crashlog::setGps(gps_data);
+  flashlog::gpsFile()->println(String(timestamp) + "," + timebase::formatUtc(timebase::now_us()) + "," + String(gps_data.gga_time) + "," + String(gps_data.fix) + "," + gps_data.latitude + "," + gps_data.longitude + "," + gps_data.altitude + "," + gps_data.accuracy_time + "," + gps_data.accuracy);
 }
 
 
@@ -154,19 +407,74 @@ void every(unsigned long timestamp, unsigned long delta)
 { 
   // update everything
   simcom::update(timestamp, delta);
+  i2c::update(timestamp, delta);
+  logging::update(timestamp, delta);
+  crashlog::update(timestamp, delta);
+  timebase::update(timestamp, delta);
+#ifdef TELEMETRY_TCP
+  tcp::update(timestamp, delta);
+#endif
+
+  // every IMU sample goes to the phase detector; how much of it reaches flash and air depends on the phase.
+  // Samples were queued by interrupts while we were busy elsewhere, so each gets back the millis() it was taken at.
+  static unsigned long last_gps_log = 0, last_sample = 0, last_upload = 0;
+  while (imu::update()) {
+    unsigned long sample_timestamp = millis() - (timebase::now_us() - imu::sampleTime()) / 1000;
+    flight::update(sample_timestamp, imu::get(), gps::get());
+    crashlog::setImu(imu::get());
+    crashlog::setPhase(flight::phase());
+    aggregate::setWindow(flight::rates().sensor_log_ms);
+    if (flight::phase()!=flight::PAD) pretrigger::trigger();
+    if (!pretrigger::triggered() || pretrigger::size()) {
+      // keep the pad history, and once it is being written out, queue behind it so rows stay in order
+      pretrigger::push(sample_timestamp, imu::sampleTime(), imu::get(), flight::phase());
+    }
+    aggregate::Window window;
+    if (aggregate::add(sample_timestamp, imu::sampleTime(), imu::get(), window) && !(pretrigger::triggered() && pretrigger::size())) {
+      logSensors(window);
+    }
+  }
+  if (pretrigger::triggered()) {
+    // a few rows per pass instead of one long SD stall right at ignition; attitude is not kept for these
+    pretrigger::Record record;
+    for (int i=0; i<16 && pretrigger::pop(record); i++) {
+      Row row;
+      row.appendSensors(record.timestamp, record.sample_us, record.phase, 1, record.data);
+      row.appendf(",,,,,,,");
+      flashlog::sensorFile()->println(row.buff);
+    }
+  }
+  if (timestamp - last_gps_log >= flight::rates().gps_log_ms) {
+    last_gps_log = timestamp;
+    logGps(timestamp);
+  }
+  if (timestamp - last_sample >= flight::rates().upload_ms) {
+    last_sample = timestamp;
+    takeSample(timestamp);
+  }
+  uplink::update(timestamp, flight::rates().upload_ms);
+  gsm::setSleep(uplink::policy().interval_ms >= modem_sleep_min_upload_ms);
+  // besides the regular requests, work off a backlog of more than one request's worth as fast as
+  // the link allows; what fits in the next regular request waits for it, so batches fill up
+  const uplink::Policy& policy = uplink::policy();
+  bool backfill = uplink::backlog() > (size_t)policy.batch && policy.backfill_ms && timestamp - last_upload >= policy.backfill_ms;
+  if (timestamp - last_upload >= policy.interval_ms || backfill) {
+    last_upload = timestamp;
+    sendData(timestamp);
+  }
 
   // reboot if not sending telemetry
   if (last_send_timestamp==0 && timestamp > first_send_deadline) {
     logger.println("Deadline reached before first successful telemetry upload. Rebooting.");
-    watchdog::reboot();
+    watchdog::reboot("no upload before first deadline");
   }
   if (last_send_timestamp!=0 && timestamp-last_send_timestamp > silence_deadline) {
     logger.println("Deadline reached before next successful telemetry upload. Rebooting.");
-    watchdog::reboot();
+    watchdog::reboot("upload silence deadline");
   }
 
-  // short delay
-  delay(10); 
+  // sleep until the next pass; interrupts keep queueing samples and serial data meanwhile
+  power::idle(10);
 }
 
 
@@ -0,0 +1,346 @@
+#include "timebase.hpp"
+#include "logging.hpp"
+#include "wiring_private.h" // pinPeripheral() function
+
+namespace timebase
+{
+  Logger& logger = logging::get(logging::TIMEBASE);
+
+  const uint8_t gclk_id = 4;        // GCLK0..3 belong to the core
+  const uint8_t event_channel = 0;
+  const uint8_t count_offset = 0x10; // COUNT32 register offsets for READREQ
+  const uint8_t cc0_offset = 0x18;
+
+  Stats stats_;
+  void (*tick_fn)() = nullptr;
+  uint32_t tick_us = 0;
+  uint32_t tick_next = 0; // CC1 would need a synchronised read
+
+  // One fit point per interval, the one that arrived soonest after its epoch: sentences only
+  // ever reach us late (UART, queued lines, a busy loop), so the least delayed is the most true.
+  struct Point
+  {
+    uint32_t us;
+    uint64_t utc_ms;
+  };
+  const int max_points = 16;
+  const uint32_t point_interval_us = 60000000; // 15 minutes of history
+  const uint32_t max_span_us = 20 * 60000000u; // points older than this are dropped
+  const uint32_t rebase_us = 10 * 60000000u;
+  const int32_t max_drift_ppb = 500000;
+  Point points[max_points];
+  int point_head = 0; // oldest
+  int point_count = 0;
+  Point candidate;
+  bool have_candidate = false;
+  int64_t candidate_residual = 0;
+
+  UtcSource source_ = UTC_NONE;
+  uint32_t base_us = 0;
+  uint64_t base_utc_ms = 0;
+  int32_t drift_ppb = 0;
+  int32_t offset_ms = 0;
+
+
+  void syncGclk()
+  {
+    while (GCLK->STATUS.bit.SYNCBUSY);
+  }
+
+  void syncTc()
+  {
+    while (TC4->COUNT32.STATUS.bit.SYNCBUSY);
+  }
+
+  // COUNT and CC are in the TC clock domain; a read has to be requested and synchronised first.
+  // Called from the main loop and from interrupts, so no one else may request in between.
+  uint32_t read(uint8_t offset)
+  {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    TC4->COUNT32.READREQ.reg = TC_READREQ_RREQ | TC_READREQ_ADDR(offset);
+    syncTc();
+    uint32_t value = offset == count_offset ? TC4->COUNT32.COUNT.reg : TC4->COUNT32.CC[0].reg;
+    __set_PRIMASK(primask);
+    return value;
+  }
+
+  void initClock()
+  {
+    // 48 MHz DFLL / 48 = 1 MHz, so one count is one microsecond without a prescaler
+    GCLK->GENDIV.reg = GCLK_GENDIV_ID(gclk_id) | GCLK_GENDIV_DIV(48);
+    syncGclk();
+    GCLK->GENCTRL.reg = GCLK_GENCTRL_ID(gclk_id) | GCLK_GENCTRL_SRC_DFLL48M | GCLK_GENCTRL_GENEN;
+    syncGclk();
+    GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID(GCM_TC4_TC5) | GCLK_CLKCTRL_GEN_GCLK4 | GCLK_CLKCTRL_CLKEN;
+    syncGclk();
+    GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID(GCM_EIC) | GCLK_CLKCTRL_GEN_GCLK0 | GCLK_CLKCTRL_CLKEN;
+    syncGclk();
+  }
+
+  void initTimer()
+  {
+    PM->APBCMASK.reg |= PM_APBCMASK_TC4 | PM_APBCMASK_TC5;
+
+    TC4->COUNT32.CTRLA.reg = TC_CTRLA_SWRST;
+    syncTc();
+    TC4->COUNT32.CTRLA.reg = TC_CTRLA_MODE_COUNT32 | TC_CTRLA_PRESCALER_DIV1 | TC_CTRLA_WAVEGEN_NFRQ;
+    TC4->COUNT32.CTRLC.reg = TC_CTRLC_CPTEN0;
+    syncTc();
+    // plain capture: the event only latches COUNT into CC0, the counter keeps running
+    TC4->COUNT32.EVCTRL.reg = TC_EVCTRL_TCEI | TC_EVCTRL_EVACT_OFF;
+    TC4->COUNT32.CTRLA.reg |= TC_CTRLA_ENABLE;
+    syncTc();
+  }
+
+  // Rising edge on the pin becomes an event for the capture. The EIC interrupt imu attaches to the
+  // same pin later only reads the result, so its latency never reaches the timestamp.
+  void initEdge(int pin)
+  {
+    PM->APBAMASK.reg |= PM_APBAMASK_EIC;
+    PM->APBCMASK.reg |= PM_APBCMASK_EVSYS;
+
+    uint32_t extint = g_APinDescription[pin].ulExtInt;
+    pinPeripheral(pin, PIO_EXTINT);
+
+    EIC->CTRL.reg &= ~EIC_CTRL_ENABLE; // CONFIG is only writable while disabled
+    while (EIC->STATUS.bit.SYNCBUSY);
+    uint32_t shift = (extint % 8) * 4;
+    EIC->CONFIG[extint / 8].reg = (EIC->CONFIG[extint / 8].reg & ~(0xfu << shift)) | (EIC_CONFIG_SENSE0_RISE_Val << shift);
+    EIC->EVCTRL.reg |= 1u << extint;
+    EIC->CTRL.reg |= EIC_CTRL_ENABLE;
+    while (EIC->STATUS.bit.SYNCBUSY);
+
+    EVSYS->USER.reg = EVSYS_USER_USER(EVSYS_ID_USER_TC4_EVU) | EVSYS_USER_CHANNEL(event_channel + 1); // channel n is written as n+1
+    EVSYS->CHANNEL.reg = EVSYS_CHANNEL_CHANNEL(event_channel) | EVSYS_CHANNEL_PATH_ASYNCHRONOUS | EVSYS_CHANNEL_EDGSEL_NO_EVT_OUTPUT | EVSYS_CHANNEL_EVGEN(EVSYS_ID_GEN_EIC_EXTINT_0 + extint);
+  }
+
+  void begin(int capture_pin)
+  {
+    initClock();
+    initTimer();
+    initEdge(capture_pin);
+    LOG_INFO(logger, "1 MHz counter on TC4, capturing pin %d", capture_pin);
+  }
+
+  uint32_t now_us()
+  {
+    return read(count_offset);
+  }
+
+  // Compare channel 1 is free while channel 0 captures, so it paces the tick off the same counter
+  void setTick(uint32_t period_us, void (*tick)())
+  {
+    tick_fn = tick;
+    tick_us = period_us;
+    tick_next = now_us() + period_us;
+    TC4->COUNT32.CC[1].reg = tick_next;
+    syncTc();
+    TC4->COUNT32.INTFLAG.reg = TC_INTFLAG_MC1;
+    TC4->COUNT32.INTENSET.reg = TC_INTENSET_MC1;
+    NVIC_SetPriority(TC4_IRQn, 1);
+    NVIC_EnableIRQ(TC4_IRQn);
+  }
+
+  void tcIrqHandler()
+  {
+    TC4->COUNT32.INTFLAG.reg = TC_INTFLAG_MC1;
+    tick_next += tick_us; // from the last match, not from now, so the period does not stretch
+    TC4->COUNT32.CC[1].reg = tick_next;
+    syncTc();
+    if (tick_fn) tick_fn();
+  }
+
+  bool lastEdge(uint32_t& us)
+  {
+    uint8_t flags = TC4->COUNT32.INTFLAG.reg;
+    if (flags & TC_INTFLAG_ERR) {
+      // CC0 could hold either edge, and only the newer one matches the data registers
+      TC4->COUNT32.INTFLAG.reg = TC_INTFLAG_ERR | TC_INTFLAG_MC0;
+      stats_.overruns++;
+      us = now_us();
+      return false;
+    }
+    if (!(flags & TC_INTFLAG_MC0)) {
+      stats_.missing++;
+      us = now_us();
+      return false;
+    }
+    us = read(cc0_offset);
+    TC4->COUNT32.INTFLAG.reg = TC_INTFLAG_MC0;
+    stats_.captures++;
+    return true;
+  }
+
+  const Stats& stats()
+  {
+    return stats_;
+  }
+
+  const char* sourceName(UtcSource source)
+  {
+    switch (source) {
+      case UTC_NONE: return "none";
+      case UTC_GSM: return "gsm";
+      case UTC_GPS: return "gps";
+    }
+    return "?";
+  }
+
+  void report()
+  {
+    LOG_INFO(logger, "%lu samples captured, %lu overruns, %lu without an edge", stats_.captures, stats_.overruns, stats_.missing);
+    if (source_ == UTC_NONE) return;
+    // pairs millis() with UTC, so the text log can be put on the same clock as the data
+    LOG_INFO(logger, "UTC %s at %lums from %s, offset %ldms, drift %ldppb, %d points", formatUtc(now_us()).c_str(), millis(), sourceName(source_), (long)offset_ms, (long)drift_ppb, point_count);
+  }
+
+  bool utc(uint32_t local_us, uint64_t& utc_ms)
+  {
+    if (source_ == UTC_NONE) return false;
+    int32_t dus = (int32_t)(local_us - base_us);
+    utc_ms = base_utc_ms + ((int64_t)dus * (1000000000 + drift_ppb)) / 1000000000000LL;
+    return true;
+  }
+
+  // Least squares through the points, relative to the newest so the numbers stay small
+  void fit()
+  {
+    const Point& newest = points[(point_head + point_count - 1) % max_points];
+    base_us = newest.us;
+    base_utc_ms = newest.utc_ms;
+    if (point_count < 2) return;
+
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (int i=0; i<point_count; i++) {
+      const Point& p = points[(point_head + i) % max_points];
+      double x = (int32_t)(p.us - newest.us);
+      double y = (int64_t)(p.utc_ms - newest.utc_ms);
+      sx += x; sy += y; sxx += x * x; sxy += x * y;
+    }
+    double n = point_count;
+    double slope = (n * sxy - sx * sy) / (n * sxx - sx * sx); // ms per us
+    double intercept = (sy - slope * sx) / n;
+
+    double drift = (slope * 1000. - 1.) * 1e9;
+    if (drift > max_drift_ppb) drift = max_drift_ppb;
+    if (drift < -max_drift_ppb) drift = -max_drift_ppb;
+    drift_ppb = (int32_t)drift;
+    base_utc_ms += (int64_t)(intercept + (intercept < 0 ? -0.5 : 0.5));
+  }
+
+  void addPoint(const Point& p)
+  {
+    // keep every point within signed reach of the newest
+    while (point_count && p.us - points[point_head].us > max_span_us) {
+      point_head = (point_head + 1) % max_points;
+      point_count--;
+    }
+    if (point_count == max_points) {
+      point_head = (point_head + 1) % max_points;
+      point_count--;
+    }
+    points[(point_head + point_count) % max_points] = p;
+    point_count++;
+    fit();
+  }
+
+  void setUtc(uint32_t local_us, uint64_t utc_ms, UtcSource source)
+  {
+    if (source < source_) return; // a network time is no use once the GPS has set the clock
+    Point p = { local_us, utc_ms };
+    if (source != source_ || source == UTC_GSM) {
+      LOG_INFO(logger, "Clock set from %s", sourceName(source));
+      source_ = source;
+      point_count = 0;
+      have_candidate = false;
+      offset_ms = 0;
+      if (source == UTC_GPS) addPoint(p);
+      else {
+        base_us = local_us;
+        base_utc_ms = utc_ms;
+      }
+      return;
+    }
+
+    uint64_t predicted;
+    utc(local_us, predicted);
+    int64_t residual = (int64_t)(utc_ms - predicted);
+    offset_ms = (int32_t)residual;
+    if (!have_candidate || residual > candidate_residual) {
+      candidate = p;
+      candidate_residual = residual;
+      have_candidate = true;
+    }
+    if (!point_count || local_us - points[(point_head + point_count - 1) % max_points].us >= point_interval_us) {
+      addPoint(candidate);
+      have_candidate = false;
+    }
+  }
+
+  void update(unsigned long timestamp, unsigned long delta)
+  {
+    if (source_ == UTC_NONE) return;
+    uint32_t now = now_us();
+    if (now - base_us < rebase_us) return;
+    // Without fresh fixes, carry the line forward along its slope before the counter gets out of reach
+    uint64_t now_utc;
+    utc(now, now_utc);
+    base_us = now;
+    base_utc_ms = now_utc;
+    if (point_count && now - points[(point_head + point_count - 1) % max_points].us > max_span_us) {
+      point_count = 0;
+      have_candidate = false;
+    }
+  }
+
+  UtcSource utcSource()
+  {
+    return source_;
+  }
+
+  int32_t offsetMs()
+  {
+    return offset_ms;
+  }
+
+  int32_t driftPpb()
+  {
+    return drift_ppb;
+  }
+
+  int32_t daysFromCivil(int year, int month, int day)
+  {
+    // Howard Hinnant's days_from_civil, for years after 1970 only
+    year -= month <= 2;
+    int32_t era = year / 400;
+    int32_t yoe = year - era * 400;
+    int32_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+  }
+
+  int formatUtc(uint32_t local_us, char* buff, size_t size)
+  {
+    uint64_t ms;
+    if (!utc(local_us, ms)) {
+      if (size) buff[0] = 0;
+      return 0;
+    }
+    return snprintf(buff, size, "%lu.%03u", (unsigned long)(ms / 1000), (unsigned)(ms % 1000));
+  }
+
+  String formatUtc(uint32_t local_us)
+  {
+    char buff[16];
+    formatUtc(local_us, buff, sizeof(buff));
+    return String(buff);
+  }
+}
+
+
+void TC4_Handler()
+{
+  timebase::tcIrqHandler();
+}
+
@@ -0,0 +1,51 @@
+#pragma once
+#include "common.hpp"
+
+// Free-running 1 MHz counter on TC4/TC5 in 32-bit mode. The IMU data ready edge is routed
+// EIC -> EVSYS -> TC4 capture channel 0, so the counter value is latched by hardware on the
+// edge itself and no interrupt or loop latency ends up in sample timestamps. The imu also takes
+// an interrupt on the same edge to start its read, but that only picks up the captured value.
+//
+// On top of the counter sits UTC: a line fitted through (counter, UTC) pairs from the GPS, or a
+// single coarse point from the network when there is no GPS time, so any counter value converts
+// in O(1). Counter differences are taken as signed 32 bits, which keeps conversions right for
+// 35 minutes either side of the fit; update() moves the fit along so that always covers now.
+namespace timebase
+{
+  enum UtcSource
+  {
+    UTC_NONE = 0,
+    UTC_GSM,  // +CIPGSMLOC, whole seconds plus however long the modem took to answer
+    UTC_GPS   // GGA, RMC or ZDA
+  };
+
+  struct Stats
+  {
+    unsigned long captures = 0;
+    unsigned long overruns = 0; // a second edge came before the first was read
+    unsigned long missing = 0;  // no edge since the last read, now_us() was used instead
+  };
+
+  void begin(int capture_pin);
+  uint32_t now_us(); // wraps every 71.6 minutes, like micros()
+  void setTick(uint32_t period_us, void (*tick)()); // tick() from the TC4 interrupt every period_us
+
+  // Time of the most recent edge that has not been read yet. Falls back to now_us() (and says
+  // so by returning false) when there was none, or when an overrun makes the capture ambiguous.
+  bool lastEdge(uint32_t& us);
+
+  const Stats& stats();
+  void report();
+
+  void update(unsigned long timestamp, unsigned long delta);
+  void setUtc(uint32_t local_us, uint64_t utc_ms, UtcSource source); // a fix of utc_ms was received at local_us
+  bool utc(uint32_t local_us, uint64_t& utc_ms); // false until some source has set the clock
+  UtcSource utcSource();
+  int32_t offsetMs(); // how far the last GPS fix was from the fitted line
+  int32_t driftPpb(); // how much slower than 1 MHz the counter runs: positive means each count is more than 1us of UTC
+
+  int32_t daysFromCivil(int year, int month, int day); // days since 1970-01-01
+  String formatUtc(uint32_t local_us); // seconds since 1970 with milliseconds, empty while unset
+  int formatUtc(uint32_t local_us, char* buff, size_t size); // the same without a String, returns the length
+}
+
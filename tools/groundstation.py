@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""Receive telemetry frames sent with TELEMETRY_TCP defined and print them as CSV rows.
+
+The rocket connects out through the modem, so this has to run somewhere reachable from the
+internet, on the port in telemetry_host/telemetry_port:
+
+    tools/groundstation.py 7373          # TCP
+    tools/groundstation.py --udp 7373
+
+The latency column is local receive time minus the frame's UTC, so it is only meaningful once the
+rocket has GPS time and this machine is NTP synced.
+
+Rows come newest first: after an outage the current sample arrives before the backlog behind it,
+so sort by seq (or logtime) to get the track in order.
+"""
+import argparse
+import socket
+import struct
+import sys
+import time
+
+FRAME = struct.Struct("<BBHIIHBBHIBBiiiiBBBBH")
+SYNC = 0x7E
+PHASES = ["pad", "boost", "coast", "apogee", "descent", "landed"]
+UTC_SOURCES = ["none", "gsm", "gps"]
+LINKS = ["good", "fair", "poor"]
+UNKNOWN = -0x80000000
+COLUMNS = "recv_utc,seq,logtime,utc,latency_ms,phase,cpu_duty,voltage,free_ram,fix,utc_source,latitude,longitude,altitude,accuracy,csq,link,batch,fail_pct,link_latency_ms"
+
+
+def fixed(value, scale):
+    return "" if value == UNKNOWN else "%.*f" % (scale, value / 10.0 ** scale)
+
+
+def row(frame, received):
+    (_, _, seq, logtime, utc_s, utc_ms, phase, duty, voltage_mv, free_ram, fix, utc_source,
+     lat, lon, alt, acc, csq, link, batch, fail_pct, link_latency) = frame
+    utc = utc_s + utc_ms / 1000.0 if utc_s else None
+    latency = "%d" % ((received - utc) * 1000) if utc and utc_source == 2 else ""
+    return ",".join([
+        "%.3f" % received, str(seq), str(logtime), "%.3f" % utc if utc else "", latency,
+        PHASES[phase] if phase < len(PHASES) else str(phase), str(duty), "%.3f" % (voltage_mv / 1000.0),
+        str(free_ram), str(fix), UTC_SOURCES[utc_source] if utc_source < len(UTC_SOURCES) else str(utc_source),
+        fixed(lat, 6), fixed(lon, 6), fixed(alt, 1), fixed(acc, 1),
+        str(csq), LINKS[link] if link < len(LINKS) else str(link), str(batch), str(fail_pct), str(link_latency),
+    ])
+
+
+def frames(buf):
+    """Split complete frames off the front of buf, skipping garbage up to the next sync byte."""
+    while True:
+        start = buf.find(bytes([SYNC]))
+        if start < 0:
+            return b"", None
+        buf = buf[start:]
+        if len(buf) < 2:
+            return buf, None
+        if buf[1] != FRAME.size:
+            buf = buf[1:]
+            continue
+        if len(buf) < FRAME.size:
+            return buf, None
+        return buf[FRAME.size:], FRAME.unpack_from(buf)
+
+
+def serve_tcp(port):
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    server.bind(("", port))
+    server.listen(1)
+    while True:
+        conn, addr = server.accept()
+        print("# connection from %s:%d" % addr, file=sys.stderr)
+        buf = b""
+        with conn:
+            while True:
+                data = conn.recv(4096)
+                if not data:
+                    break
+                buf += data
+                while True:
+                    buf, frame = frames(buf)
+                    if frame is None:
+                        break
+                    print(row(frame, time.time()), flush=True)
+        print("# connection closed", file=sys.stderr)
+
+
+def serve_udp(port):
+    server = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    server.bind(("", port))
+    while True:
+        data, _ = server.recvfrom(4096)
+        while True:  # a batch of samples shares a datagram
+            data, frame = frames(data)
+            if frame is None:
+                break
+            print(row(frame, time.time()), flush=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("port", type=int)
+    parser.add_argument("--udp", action="store_true")
+    args = parser.parse_args()
+    print(COLUMNS, flush=True)
+    (serve_udp if args.udp else serve_tcp)(args.port)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+"""Render a binary event log (LOGnnnnn/EVT.BIN, written when LOG_BINARY is defined) back to text.
+
+The records only carry the flash address of their printf format string, so the ELF of the exact
+build that wrote the log is needed to look the formats up:
+
+    tools/logdecode.py telemetry-code.ino.elf LOG00012/EVT.BIN
+"""
+import re
+import struct
+import sys
+
+LEVELS = ["", "", "warning: ", "error: "]
+TRUNCATED = 0x80  # logging::event_truncated
+CONVERSION = re.compile(r"%([-+ #0]*\d*(?:\.\d+)?)(hh|h|ll|l|z|j|t)?([diouxXcsfFeEgGp%])")
+
+
+class Elf:
+    """Just enough of ELF32 to read bytes at a load address."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+        if self.data[:4] != b"\x7fELF" or self.data[4] != 1:
+            raise SystemExit("%s: not a 32-bit ELF" % path)
+        shoff, = struct.unpack_from("<I", self.data, 0x20)
+        shentsize, shnum = struct.unpack_from("<HH", self.data, 0x2e)
+        self.sections = []
+        for i in range(shnum):
+            _, sh_type, flags, addr, offset, size = struct.unpack_from("<IIIIII", self.data, shoff + i * shentsize)
+            if sh_type == 1 and flags & 0x2:  # PROGBITS, ALLOC
+                self.sections.append((addr, offset, size))
+
+    def string(self, address):
+        for addr, offset, size in self.sections:
+            if addr <= address < addr + size:
+                start = offset + address - addr
+                end = self.data.index(b"\0", start)
+                return self.data[start:end].decode("latin-1")
+        return None
+
+
+def render(fmt, args, truncated=False):
+    out = []
+    pos = 0
+    last = 0
+    for m in CONVERSION.finditer(fmt):
+        out.append(fmt[last:m.start()])
+        last = m.end()
+        flags, _, conv = m.groups()
+        if conv == "%":
+            out.append("%")
+            continue
+        if truncated and pos >= len(args):  # the rest did not fit the record
+            out.append("<truncated>")
+            return "".join(out)
+        if conv == "s":
+            n = args[pos]
+            value = args[pos + 1:pos + 1 + n].decode("latin-1")
+            pos += 1 + n
+        elif conv in "fFeEgG":
+            value, = struct.unpack_from("<f", args, pos)
+            pos += 4
+        elif conv in "di":
+            value, = struct.unpack_from("<i", args, pos)
+            pos += 4
+        else:
+            value, = struct.unpack_from("<I", args, pos)
+            pos += 4
+            if conv == "p":
+                conv, flags = "x", "#"
+        out.append(("%" + flags + conv) % value)
+    out.append(fmt[last:])
+    return "".join(out)
+
+
+def decode(elf, path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if data[:4] != b"EVT1":
+        raise SystemExit("%s: not an event log" % path)
+    pos = 0
+    names = []
+
+    while pos + 12 <= len(data):
+        if data[pos:pos + 4] == b"EVT1":  # file start, or a warm restart appending to the file
+            count = data[pos + 4]
+            pos += 5
+            names = []
+            for _ in range(count):
+                end = data.index(b"\0", pos)
+                names.append(data[pos:end].decode("latin-1"))
+                pos = end + 1
+            continue
+        if data[pos] != 0xa5:
+            pos += 1  # resync after a torn write
+            continue
+        logger_id, level, length, timestamp, address = struct.unpack_from("<BBBII", data, pos + 1)
+        truncated = level & TRUNCATED
+        level &= ~TRUNCATED
+        args = data[pos + 12:pos + 12 + length]
+        pos += 12 + length
+        name = names[logger_id] if logger_id < len(names) else "#%d" % logger_id
+        fmt = elf.string(address)
+        if fmt is None:
+            text = "<unknown format 0x%08x> %s" % (address, args.hex())
+        else:
+            try:
+                text = render(fmt, args, truncated)
+            except (struct.error, IndexError):
+                text = "<bad arguments for \"%s\"> %s" % (fmt, args.hex())
+        prefix = LEVELS[level] if level < len(LEVELS) else ""
+        print("%10.3f %s> %s%s" % (timestamp / 1000.0, name, prefix, text))
+
+
+def main():
+    if len(sys.argv) < 3:
+        raise SystemExit(__doc__)
+    elf = Elf(sys.argv[1])
+    for path in sys.argv[2:]:
+        decode(elf, path)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,231 @@
+#include "uplink.hpp"
+#include "gsm.hpp"
+#include "logging.hpp"
+#include "flashlog.hpp"
+#include "crashlog.hpp"
+#include <SD.h>
+#include <deque>
+#include <algorithm>
+
+namespace uplink
+{
+  Logger& logger = logging::get(logging::UPLINK);
+
+  // CSQ 10 is about -93 dBm, 15 about -83 dBm
+  const long csq_good = 15;
+  const long csq_poor = 10;
+  const unsigned long latency_good_ms = 3000;
+  const unsigned long latency_poor_ms = 8000;
+  const int fail_good_pm = 100;
+  const int fail_poor_pm = 300;
+  const int batches[] = {1, 2, 4}; // by Link; 4 keeps a request within the silence deadline on the pad
+  const unsigned long backfills_ms[] = {1000, 3000, 0}; // by Link; a poor link gets no extra requests
+
+  const size_t ram_max = 32;
+  const size_t ram_refill = 8;   // pull samples back from the card when RAM holds fewer
+  const uint32_t sd_max = 2048;  // about 94 KB
+
+  Policy policy_;
+  Metrics metrics_;
+  int fail_pm = 0; // per mille, so the moving average does not round away
+
+  std::deque<Frame> ram; // oldest first
+  std::vector<Frame> in_flight;
+  uint16_t next_seq = 0;
+  File* sd_file = nullptr;
+  uint32_t sd_head = 0;  // slot the next spilled sample goes to
+  uint32_t sd_count = 0;
+  unsigned long dropped = 0;
+
+
+  Link classify()
+  {
+    if (metrics_.csq < csq_poor || metrics_.csq == 99 || metrics_.latency_ms > latency_poor_ms || fail_pm > fail_poor_pm) return LINK_POOR;
+    if (metrics_.csq >= csq_good && metrics_.latency_ms < latency_good_ms && fail_pm < fail_good_pm) return LINK_GOOD;
+    return LINK_FAIR;
+  }
+
+  const char* linkName(Link link)
+  {
+    switch (link) {
+      case LINK_GOOD: return "good";
+      case LINK_FAIR: return "fair";
+      case LINK_POOR: return "poor";
+    }
+    return "?";
+  }
+
+  bool seqBefore(uint16_t a, uint16_t b)
+  {
+    return (int16_t)(a - b) < 0;
+  }
+
+  // kept in the crash record for a warm restart
+  void saveState()
+  {
+    crashlog::setUplink(next_seq, sd_head, sd_count);
+  }
+
+  // The card is a stack in a ring of slots: spills go on top, refills come off the top, and
+  // once all slots are used the next spill overwrites the oldest
+  void spill()
+  {
+    const Frame& frame = ram.front();
+    if (!*sd_file) {
+      dropped++;
+    } else {
+      if (sd_count == sd_max) dropped++;
+      sd_file->seek(sd_head * sizeof(Frame));
+      sd_file->write(reinterpret_cast<const uint8_t*>(&frame), sizeof(Frame));
+      sd_head = (sd_head + 1) % sd_max;
+      sd_count = std::min(sd_count + 1, sd_max);
+      saveState();
+    }
+    ram.pop_front();
+  }
+
+  void refill()
+  {
+    while (ram.size() < ram_refill && sd_count) {
+      sd_head = (sd_head + sd_max - 1) % sd_max;
+      sd_count--;
+      Frame frame;
+      sd_file->seek(sd_head * sizeof(Frame));
+      saveState();
+      if (sd_file->read(&frame, sizeof(Frame)) != sizeof(Frame) || frame.sync != 0x7e) { // also what was not flushed before a reset
+        LOG_WARNING(logger, "Bad backlog slot %lu", (unsigned long)sd_head);
+        dropped++;
+        continue;
+      }
+      ram.push_front(frame);
+    }
+  }
+
+  void insert(const Frame& frame)
+  {
+    auto pos = ram.end();
+    while (pos != ram.begin() && seqBefore(frame.seq, (pos - 1)->seq)) --pos;
+    ram.insert(pos, frame);
+    while (ram.size() > ram_max) spill();
+  }
+
+  // What was in RAM is lost in a reset; what was spilled is still in the session's UPL.BIN
+  void begin(const crashlog::Resume* resume)
+  {
+    sd_file = flashlog::uplinkFile();
+    if (!*sd_file) LOG_WARNING(logger, "Backlog is limited to RAM");
+    if (resume && resume->uplink_head < sd_max && resume->uplink_count <= sd_max) {
+      next_seq = resume->uplink_seq;
+      if (*sd_file) {
+        sd_head = resume->uplink_head;
+        sd_count = resume->uplink_count;
+      }
+      LOG_INFO(logger, "Resuming at sample %u with %lu on card", next_seq, (unsigned long)sd_count);
+    }
+    saveState();
+  }
+
+  void update(unsigned long timestamp, unsigned long sample_ms)
+  {
+    metrics_.csq = gsm::signalStrength();
+    Link link = classify();
+    if (link != policy_.link) {
+      LOG_INFO(logger, "Link %s -> %s (csq %ld, %lums, %d%% failed)", linkName(policy_.link), linkName(link), metrics_.csq, metrics_.latency_ms, metrics_.fail_pct);
+      policy_.link = link;
+    }
+    policy_.batch = batches[link];
+    policy_.interval_ms = sample_ms * policy_.batch;
+    policy_.backfill_ms = backfills_ms[link];
+  }
+
+  void result(bool ok, unsigned long latency_ms)
+  {
+    fail_pm += ((ok ? 0 : 1000) - fail_pm) / 4;
+    metrics_.fail_pct = fail_pm / 10;
+    if (ok) metrics_.latency_ms = metrics_.latency_ms ? (3 * metrics_.latency_ms + latency_ms) / 4 : latency_ms;
+  }
+
+  const Policy& policy()
+  {
+    return policy_;
+  }
+
+  const Metrics& metrics()
+  {
+    return metrics_;
+  }
+
+  void report()
+  {
+    LOG_INFO(logger, "Link %s: csq %ld, %lums, %d%% failed; %d per request every %lums", linkName(policy_.link), metrics_.csq, metrics_.latency_ms, metrics_.fail_pct,
+      policy_.batch, policy_.interval_ms);
+    LOG_INFO(logger, "Backlog %u in RAM, %lu on card, %lu dropped", (unsigned)ram.size(), (unsigned long)sd_count, dropped);
+  }
+
+  void push(Frame& frame)
+  {
+    frame.seq = next_seq++;
+    saveState();
+    ram.push_back(frame);
+    while (ram.size() > ram_max) spill();
+  }
+
+  std::vector<Frame> take(int max)
+  {
+    if (!in_flight.empty()) {
+      LOG_ERROR(logger, "Request already in flight");
+      return std::vector<Frame>();
+    }
+    refill();
+    while ((int)in_flight.size() < max && ram.size()) {
+      in_flight.push_back(ram.back());
+      ram.pop_back();
+    }
+    return in_flight;
+  }
+
+  void sent(bool ok)
+  {
+    if (!ok) {
+      for (const Frame& frame : in_flight) insert(frame);
+    }
+    in_flight.clear();
+  }
+
+  size_t backlog()
+  {
+    return ram.size() + sd_count;
+  }
+
+  int32_t toFixed(const String& str, int scale)
+  {
+    int i = 0;
+    bool neg = false;
+    if (i < str.length() && (str[i]=='-' || str[i]=='+')) neg = str[i++]=='-';
+    if (i >= str.length() || !(isdigit(str[i]) || str[i]=='.')) return INT32_MIN; // empty or NaN
+    int32_t value = 0;
+    int decimals = -1;
+    for (; i < str.length(); i++) {
+      if (str[i]=='.' && decimals<0) decimals = 0;
+      else if (!isdigit(str[i])) break;
+      else if (decimals < scale) {
+        value = value * 10 + (str[i] - '0');
+        if (decimals >= 0) decimals++;
+      }
+    }
+    for (decimals = std::max(decimals, 0); decimals < scale; decimals++) value *= 10;
+    return neg ? -value : value;
+  }
+
+  String fromFixed(int32_t value, int scale)
+  {
+    if (value == INT32_MIN) return "NaN";
+    uint32_t abs = value < 0 ? -(uint32_t)value : value;
+    uint32_t div = 1;
+    for (int i = 0; i < scale; i++) div *= 10;
+    String frac = String(abs % div);
+    while (frac.length() < scale) frac = "0" + frac;
+    return String(value < 0 ? "-" : "") + String(abs / div) + (scale ? "." + frac : "");
+  }
+}
+
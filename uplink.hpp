@@ -0,0 +1,85 @@
+#pragma once
+#include "common.hpp"
+#include "crashlog.hpp"
+#include <vector>
+
+// What goes up, and how much of it per request. Samples are taken at the phase's upload rate
+// (flight::rates()), and how many share a request depends on the link: one each while it is
+// good, batches of two or four when it is marginal, so fewer requests pay for connection setup
+// and headers and fewer of them time out. The link is judged by signal strength (+CSQ) and by
+// how recent requests went: their latency and how many failed.
+//
+// Samples wait in a backlog. Requests carry the newest sample first and fill up with the backlog
+// from newest to oldest, so after an outage the current position arrives first and the track
+// fills in behind it over later requests; seq lets the ground side put rows back in order. The
+// backlog keeps up to 32 samples in RAM and spills the oldest to UPL.BIN in the session
+// directory, a ring of 2048 that loses the oldest once full.
+namespace uplink
+{
+  enum Link
+  {
+    LINK_GOOD = 0,
+    LINK_FAIR,
+    LINK_POOR
+  };
+
+  struct Policy
+  {
+    Link link = LINK_POOR;
+    int batch = 1;               // samples per request
+    unsigned long interval_ms = 0; // between requests
+    unsigned long backfill_ms = 0; // between requests while there is a backlog, 0 for none extra
+  };
+
+  struct Metrics
+  {
+    long csq = 0;
+    unsigned long latency_ms = 0; // moving average over successful requests
+    int fail_pct = 0;             // moving average over roughly the last four requests
+  };
+
+  // One sample, as uploaded. Little endian, as decoded by tools/groundstation.py. No checksum:
+  // TCP and UDP carry their own, the sync byte and length are only there to find frame
+  // boundaries in the stream.
+  struct __attribute__((packed)) Frame
+  {
+    uint8_t sync = 0x7e;
+    uint8_t length = sizeof(Frame);
+    uint16_t seq;
+    uint32_t logtime;     // millis() when taken
+    uint32_t utc_s;       // 0 while unset
+    uint16_t utc_ms;
+    uint8_t phase;
+    uint8_t cpu_duty;     // percent
+    uint16_t voltage_mv;
+    uint32_t free_ram;
+    uint8_t fix;
+    uint8_t utc_source;   // timebase::UtcSource
+    int32_t latitude_e6;  // INT32_MIN when unknown
+    int32_t longitude_e6;
+    int32_t altitude_dm;
+    int32_t accuracy_dm;
+    uint8_t csq;          // link metrics and policy when taken
+    uint8_t link;
+    uint8_t batch;
+    uint8_t fail_pct;
+    uint16_t latency_ms;
+  };
+
+  void begin(const crashlog::Resume* resume = nullptr); // after flashlog::begin; resume: carry on with the previous session's backlog
+  void update(unsigned long timestamp, unsigned long sample_ms);
+  void result(bool ok, unsigned long latency_ms); // after every request
+  const Policy& policy();
+  const Metrics& metrics();
+  const char* linkName(Link link);
+  void report();
+
+  void push(Frame& frame); // numbers it
+  std::vector<Frame> take(int max); // newest first; in flight until sent(), and nothing more until then
+  void sent(bool ok); // what failed goes back into the backlog
+  size_t backlog();
+
+  int32_t toFixed(const String& str, int scale); // "-12.3456" to -123456 with scale 4, INT32_MIN for NaN
+  String fromFixed(int32_t value, int scale);   // and back
+}
+
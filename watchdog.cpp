@@ -1,12 +1,13 @@
 #include "logging.hpp"
 #include "watchdog.hpp"
+#include "crashlog.hpp"
 #include <algorithm>
 
 // https://forum.arduino.cc/index.php?topic=366836.0
 
 namespace
 {
-  Logger& logger = logging::get("watchdog");
+  Logger& logger = logging::get(logging::WATCHDOG);
   
   static void   WDTsync() {
     while (WDT->STATUS.bit.SYNCBUSY == 1); //Just wait till WDT is free
@@ -62,9 +63,11 @@ namespace watchdog
     if (inited) resetWDT();
   }
   
-  void reboot()
+  void reboot(const char* reason)
   {
-    logger.println("Rebooting");
+    logging::emergency();
+    crashlog::setReason(reason);
+    LOG_ERROR(logger, "Rebooting: %s", reason);
     logger.flush();
     begin();
     systemReset();    
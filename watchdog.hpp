@@ -3,7 +3,7 @@
 
 namespace watchdog
 {
-  void reboot();
+  void reboot(const char* reason = "watchdog::reboot"); // reason is kept for the next boot by crashlog
   void begin();
   void tickle();
 }